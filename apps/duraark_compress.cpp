@@ -3,24 +3,78 @@
 #include <sstream>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <iterator>
 #include <cstdio>
 #include <cstdlib>
 #include <sys/fcntl.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
 namespace fs = boost::filesystem;
 namespace po = boost::program_options;
 
+#include <pcl/common/io.h>
+
 #include <pcl_compress/compress.hpp>
 #include <pcl_compress/decompress.hpp>
 #include <pcl_compress/zlib.hpp>
 #include <decomposition.hpp>
+#include <compact_cloud.hpp>
+#include <global_data.hpp>
+#include <patch_codec.hpp>
+#include <ifc.hpp>
+#include <triangle_bvh.hpp>
+#include <e57_session.hpp>
+#include <checksum.hpp>
+#include <cancellation.hpp>
+#include <progress.hpp>
+#include <atomic_file.hpp>
+#include <checkpoint.hpp>
+#include <reorder.hpp>
 using namespace duraark_compress;
 
 #include "block_info.hpp"
 
+// scan accessors shared by the pcl and the compact scan layout
+vec3f_t scan_origin(const cloud_normal_t& cloud) {
+    return cloud.sensor_origin_.head(3);
+}
+
+vec3f_t scan_origin(const compact_cloud& cloud) {
+    return cloud.sensor_origin();
+}
+
+vec3f_t scan_point(const cloud_normal_t& cloud, uint32_t idx) {
+    return cloud.points[idx].getVector3fMap();
+}
+
+vec3f_t scan_point(const compact_cloud& cloud, uint32_t idx) {
+    return cloud.point(idx);
+}
+
+cloud_normal_t::Ptr scan_subset(const cloud_normal_t& cloud, const subset_t& subset) {
+    cloud_normal_t::Ptr result(new cloud_normal_t());
+    pcl::copyPointCloud(cloud, subset, *result);
+    return result;
+}
+
+compact_cloud::ptr_t scan_subset(const compact_cloud& cloud, const subset_t& subset) {
+    return std::make_shared<compact_cloud>(cloud, subset);
+}
 
+// Flat quadtree cells may hold up to flat_cell_factor times max_points
+// points. Their images grow by powers of two so that they keep roughly the
+// point density of regular patches.
+vec2i_t patch_image_size(const vec2i_t& img_size, uint32_t point_count, int32_t max_points, float planarity, float flat_cell_factor) {
+    if (planarity <= 0.f || max_points <= 0 || point_count <= static_cast<uint32_t>(max_points)) return img_size;
+    float scale = std::sqrt(std::min(static_cast<float>(point_count) / max_points, std::max(1.f, flat_cell_factor)));
+    return img_size * (1 << static_cast<int>(std::round(std::log2(scale))));
+}
 
 int
 main(int argc, char const* argv[]) {
@@ -42,27 +96,59 @@ main(int argc, char const* argv[]) {
     uint32_t max_octree_depth;
     float min_octree_leaf;
     float ratio;
+    float tile_size;
+    float tile_overlap;
+    float ifc_distance;
+    float planarity;
+    float flat_cell_factor;
+    bool merge_flat_cells;
+    bool spatial_reorder;
+    uint32_t atlas_size;
+    uint32_t load_batch;
+    uint32_t threads;
+    std::string file_progress;
+    std::string checkpoint_dir;
+    bool use_checkpoints;
+    bool resume;
+    bool compact;
+    bool legacy_gdata;
 
     po::options_description desc("jpeg2000_test command line options");
     desc.add_options()("help,h", "Help message")
         ("input-cloud,i", po::value<std::string>(&file_in)->required(), "E57n input file")
         ("input-ifc,m", po::value<std::string>(&file_ifc)->default_value(""), "Optional IFCmesh input file (in conjunction with --input-reg/-r)")
         ("input-reg,r", po::value<std::string>(&file_reg)->default_value(""), "Optional registration RDF input file (in conjunction with --input-ifc/-m)")
+        ("ifc-distance", po::value<float>(&ifc_distance)->default_value(0.1f), "Maximum distance of points to the IFC element they are assigned to")
+        ("load-batch", po::value<uint32_t>(&load_batch)->default_value(1), "Number of scans loaded ahead of processing (more scans need more memory)")
         ("output,o", po::value<std::string>(&file_out)->required(), "Compressed output E57n file")
         ("output-json,j", po::value<std::string>(&file_json)->default_value(""), "Optional JSON metadata output file")
+        ("progress", po::value<std::string>(&file_progress)->default_value(""), "Write progress as JSON lines to this file (\"-\" => stderr)")
         ("ratio", po::value<float>(&ratio)->default_value(-1.f), "Compression ratio in [0,1] (overrides most compression parameters)")
         ("img-size,s", po::value<int>(&img_size[0])->default_value(32), "Image width and height")
         ("blur-iterations,b", po::value<uint32_t>(&blur_iters)->default_value(8), "Number of blur iterations")
         ("max-points-per-cell,m", po::value<int32_t>(&max_points)->default_value(-1), "Point count threshold for subdividing quadtree cells (Default: -1 => Use img-size * img-size).")
         ("quality,q", po::value<uint32_t>(&quality)->default_value(35), "JPEG2000 quality setting (try 35-40)")
+        ("atlas-size", po::value<uint32_t>(&atlas_size)->default_value(0), "Tile patch images into atlases of this width and height before encoding, at least twice the image size (Default: 0 => Encode every patch image separately)")
         ("min-points", po::value<uint32_t>(&min_points)->default_value(20000), "Minimum number of points per primitive")
         ("angle-threshold", po::value<float>(&angle_threshold)->default_value(0.05f), "Maximum cosine angle deviation for primitives")
         ("dist-threshold", po::value<float>(&epsilon)->default_value(0.05f), "Maximum distance to surface deviation for primitives")
         ("bitmap-epsilon", po::value<float>(&bitmap_eps)->default_value(0.1f), "Size of primitive occupancy map pixel")
         ("min-area", po::value<float>(&min_area)->default_value(0.f), "Minimum area of accepted primitives")
         ("probability-threshold", po::value<float>(&prob)->default_value(0.001f), "Shortcut probability for the RANSAC")
+        ("tile-size", po::value<float>(&tile_size)->default_value(0.f), "Detect primitives in parallel on xy tiles of this size (Default: 0 => Detect on whole scan)")
+        ("tile-overlap", po::value<float>(&tile_overlap)->default_value(0.5f), "Overlap of neighboring tiles used to merge primitives across tile borders")
+        ("planarity-threshold", po::value<float>(&planarity)->default_value(0.f), "Split quadtree cells on primitives by planarity: cells whose height standard deviation is below this value are considered flat (Default: 0 => Split by point count only)")
+        ("flat-cell-factor", po::value<float>(&flat_cell_factor)->default_value(4.f), "Flat cells may hold this factor more points than max-points-per-cell (their images grow by powers of two up to the square root of this factor to keep the point density), non-flat cells are split down to max-points-per-cell divided by this factor")
+        ("merge-flat-cells", po::bool_switch(&merge_flat_cells), "Merge flat sibling quadtree cells (requires --planarity-threshold)")
         ("max-octree-depth", po::value<uint32_t>(&max_octree_depth)->default_value(6), "Maximum tree depth of octree")
         ("min-octree-leaf-size", po::value<float>(&min_octree_leaf)->default_value(0.2f), "Minimum leaf size of octree cells")
+        ("threads", po::value<uint32_t>(&threads)->default_value(0), "Number of worker threads (Default: 0 => All cores). The archive does not depend on this setting")
+        ("checkpoint", po::bool_switch(&use_checkpoints), "Persist the result of every scan as it completes")
+        ("checkpoint-dir", po::value<std::string>(&checkpoint_dir)->default_value(""), "Directory for scan checkpoints (Default: <output>.ckpt)")
+        ("resume", po::bool_switch(&resume), "Reuse valid scan checkpoints of a previous run with the same input and parameters (implies --checkpoint)")
+        ("legacy-global-data", po::bool_switch(&legacy_gdata), "Store the global patch table in the legacy (zlib compressed cereal) format")
+        ("spatial-reorder", po::bool_switch(&spatial_reorder), "Sort scan points along a Morton curve before decomposition for cache friendly access")
+        ("compact", po::bool_switch(&compact), "Load scans straight into a compact layout (float coordinates, quantized normals) and detect primitives on bounded xy tiles to reduce memory usage")
     ;
 
     // Check for required options.
@@ -91,6 +177,12 @@ main(int argc, char const* argv[]) {
         max_points = static_cast<int32_t>((1.f + ratio * 9.f) * img_size[0] * img_size[0]);
     }
 
+#ifdef _OPENMP
+    if (threads) omp_set_num_threads(threads);
+#endif
+
+    install_cancel_handlers();
+
     if ((file_ifc != "") != (file_reg != "")) {
         std::cerr << "Options --input-ifc/-m and --input-reg/-r may only be used in conjuntion. Aborting." << "\n";
         return 1;
@@ -109,6 +201,10 @@ main(int argc, char const* argv[]) {
 
     img_size[1] = img_size[0];
     if (max_points < 0) max_points = img_size[0] * img_size[1];
+    if (atlas_size && atlas_size < 2 * static_cast<uint32_t>(img_size[0])) {
+        std::cerr << "Atlas size " << atlas_size << " is below twice the image size " << img_size[0] << " (use at least " << 2 * img_size[0] << " or 0 to disable atlases). Aborting." << "\n";
+        return 1;
+    }
 
     prim_detect_params_t params = {
         min_points,
@@ -116,95 +212,349 @@ main(int argc, char const* argv[]) {
         epsilon,
         bitmap_eps,
         min_area,
-        prob
+        prob,
+        tile_size,
+        tile_overlap,
+        planarity,
+        flat_cell_factor,
+        merge_flat_cells
+    };
+
+    // checkpoints are only reused for the same inputs and parameters
+    use_checkpoints = use_checkpoints || resume;
+    if (checkpoint_dir == "") checkpoint_dir = file_out + ".ckpt";
+    uint32_t fingerprint = 0;
+    if (use_checkpoints) {
+        std::ostringstream state;
+        for (const auto& file : {file_in, file_ifc, file_reg}) {
+            state << file << ";";
+            if (file != "" && fs::exists(file)) {
+                state << fs::file_size(file) << ";" << fs::last_write_time(file) << ";";
+            }
+        }
+        state << img_size[0] << ";" << blur_iters << ";" << max_points << ";" << quality << ";"
+              << min_points << ";" << angle_threshold << ";" << epsilon << ";" << bitmap_eps << ";"
+              << min_area << ";" << prob << ";" << tile_size << ";" << tile_overlap << ";"
+              << max_octree_depth << ";" << min_octree_leaf << ";" << ifc_distance << ";"
+              << atlas_size << ";" << compact << ";" << planarity << ";"
+              << flat_cell_factor << ";" << merge_flat_cells << ";" << spatial_reorder;
+        std::string data = state.str();
+        fingerprint = crc32c(data.data(), data.size());
+        fs::create_directories(checkpoint_dir);
+    }
+
+    ifc_mesh::ptr_t mesh;
+    triangle_bvh::ptr_t bvh;
+    transforms_t registration;
+    e57_session::ptr_t session;
+    try {
+        session = std::make_shared<e57_session>(path_in.string());
+    } catch (std::exception& e) {
+        std::cerr << e.what() << ". Aborting." << "\n";
+        return 1;
+    }
+    uint32_t scan_count = session->scan_count();
+    if (ifc_mode) {
+        std::cout << "loading IFC mesh..." << "\n";
+        try {
+            mesh = ifc_mesh::load_obj(file_ifc);
+            bvh = std::make_shared<triangle_bvh>(mesh);
+            registration = load_registration(file_reg);
+        } catch (std::exception& e) {
+            std::cerr << e.what() << ". Aborting." << "\n";
+            return 1;
+        }
+        if (registration.size() != 1 && registration.size() != scan_count) {
+            std::cerr << "Registration file contains " << registration.size() << " transformations for " << scan_count << " scans. Aborting." << "\n";
+            return 1;
+        }
+    }
+
+    // decomposes a (partial) scan cloud and computes its patches
+    auto compute_patches = [&] (cloud_normal_t::Ptr& cloud, std::vector<pcl_compress::patch_t>& patches, std::vector<uint32_t>& point_counts) {
+        decomposition_t decomp = primitive_decomposition<point_normal_t>(
+            cloud, params, max_points, max_octree_depth, min_octree_leaf);
+        for (const auto& subset : decomp) {
+            checkpoint();
+            vec2i_t patch_size = patch_image_size(img_size, subset.size(), max_points, planarity, flat_cell_factor);
+            pcl_compress::patch_t patch =
+                pcl_compress::compute_patch(cloud, subset, patch_size, blur_iters);
+            patches.push_back(patch);
+            point_counts.push_back(subset.size());
+        }
+    };
+    // same for compact scans, the cloud is released as soon as all patches
+    // have been computed
+    auto compute_compact_patches = [&] (compact_cloud::ptr_t& cloud, std::vector<pcl_compress::patch_t>& patches, std::vector<uint32_t>& point_counts) {
+        decomposition_t decomp = primitive_decomposition(
+            *cloud, params, max_points, max_octree_depth, min_octree_leaf);
+        // patch point buffers are reused from patch to patch
+        cloud_normal_t::Ptr patch_cloud(new cloud_normal_t());
+        subset_t patch_subset;
+        for (const auto& subset : decomp) {
+            checkpoint();
+            cloud->extract(subset, *patch_cloud);
+            patch_subset.resize(subset.size());
+            std::iota(patch_subset.begin(), patch_subset.end(), 0);
+            vec2i_t patch_size = patch_image_size(img_size, subset.size(), max_points, planarity, flat_cell_factor);
+            pcl_compress::patch_t patch =
+                pcl_compress::compute_patch(patch_cloud, patch_subset, patch_size, blur_iters);
+            patches.push_back(patch);
+            point_counts.push_back(subset.size());
+        }
+        cloud.reset();
     };
 
     std::vector<block_info> blocks;
+    std::vector<std::vector<uint32_t>> element_patches(mesh ? mesh->elements().size() : 0);
+    std::vector<uint32_t> residual_patches;
+    uint32_t patch_offset = 0;
     pcl_compress::compressed_cloud_t result;
     pcl_compress::merged_global_data_t merged_gdata;
-    if (ifc_mode) {
-        throw std::runtime_error("IFC based compression has not been implemented yet!");
-    } else {
-        uint32_t scan_count = e57_pcl::get_scan_count(path_in.string());
-        for (uint32_t scan_idx = 0; scan_idx < scan_count; ++scan_idx) {
-            std::string guid;
+    // atlases are stored after the chunks of all patches
+    std::vector<pcl_compress::chunk_t> atlas_chunks;
+    bool atlas_mode = atlas_size > 0;
+    std::ofstream progress_file;
+    progress_reporter::ptr_t progress;
+    if (file_progress != "") {
+        uint64_t total_points = 0;
+        for (uint32_t i = 0; i < scan_count; ++i) {
+            total_points += session->scan(i).point_count;
+        }
+        std::ostream* progress_out = &std::cerr;
+        if (file_progress != "-") {
+            progress_file.open(file_progress.c_str());
+            progress_out = &progress_file;
+        }
+        progress = std::make_shared<progress_reporter>(*progress_out, scan_count, total_points);
+    }
 
-            std::cout << "processing scan " << scan_idx << "..." << "\n";
-            cloud_normal_t::Ptr cloud_in = e57_pcl::load_e57_scans_with_normals(
-                path_in.string(), guid, true, nullptr, {scan_idx})[0];
+    // appends the results of a (computed or restored) scan
+    auto append_scan = [&] (scan_checkpoint_t& scan) {
+        uint32_t count = scan.gdata.origins.size();
+        block_info block;
+        block.type = block_type_t::scan;
+        block.patch_indices = std::vector<uint32_t>(count, 0);
+        std::iota(block.patch_indices.begin(), block.patch_indices.end(), patch_offset);
+        blocks.push_back(block);
 
-            bbox3f_t bbox;
-            for (const auto& p : cloud_in->points) {
-                bbox.extend(p.getVector3fMap());
+        for (uint32_t e = 0; e < scan.element_patches.size(); ++e) {
+            std::vector<uint32_t>& indices = e < element_patches.size() ? element_patches[e] : residual_patches;
+            for (const auto& idx : scan.element_patches[e]) {
+                indices.push_back(patch_offset + idx);
+            }
+        }
+        patch_offset += count;
+
+        rebase_atlas_references(scan.chunks, atlas_chunks.size());
+        std::move(scan.chunks.begin(), scan.chunks.end(), std::back_inserter(result.patch_image_data));
+        std::move(scan.atlas_chunks.begin(), scan.atlas_chunks.end(), std::back_inserter(atlas_chunks));
+        append_global_data(merged_gdata, scan.gdata);
+    };
+
+    // decomposes, compresses and appends a loaded scan, cloud_in is either a
+    // pcl cloud (compute_patches) or a compact cloud (compute_compact_patches)
+    auto process_scan = [&] (auto& cloud_in, auto&& compute, scan_checkpoint_t& scan) {
+        vec3f_t origin = scan_origin(*cloud_in);
+        uint64_t scan_points = cloud_in->size();
+        if (spatial_reorder) {
+            std::cout << "\treordering points..." << "\n";
+            apply_order(*cloud_in, morton_order(*cloud_in));
+        }
+
+        std::vector<pcl_compress::patch_t> patches;
+        std::vector<uint32_t> point_counts;
+        if (ifc_mode) {
+            std::cout << "\tassigning points to IFC elements..." << "\n";
+            const Eigen::Matrix4f& transform = registration[registration.size() == 1 ? 0 : scan.scan_index];
+            std::vector<int32_t> assignment(cloud_in->size(), -1);
+            #pragma omp parallel for schedule(dynamic, 4096)
+            for (uint32_t i = 0; i < cloud_in->size(); ++i) {
+                if (cancel_requested()) continue;
+                vec3f_t p = (transform * scan_point(*cloud_in, i).homogeneous()).head(3);
+                if (auto hit = bvh->closest(p, ifc_distance)) {
+                    assignment[i] = mesh->faces()[hit->face].element;
+                }
+            }
+            checkpoint();
+            // last subset holds the residual points
+            uint32_t residual = element_patches.size();
+            std::vector<subset_t> element_subsets(residual + 1);
+            for (uint32_t i = 0; i < assignment.size(); ++i) {
+                element_subsets[assignment[i] < 0 ? residual : assignment[i]].push_back(i);
+            }
+            // elements with too few points for a patch go to the residual
+            for (uint32_t e = 0; e < residual; ++e) {
+                if (element_subsets[e].empty() || element_subsets[e].size() >= 5) continue;
+                element_subsets[residual].insert(element_subsets[residual].end(), element_subsets[e].begin(), element_subsets[e].end());
+                subset_t().swap(element_subsets[e]);
             }
 
             std::cout << "\tcomputing patches..." << "\n";
-            decomposition_t decomp = primitive_decomposition<point_normal_t>(
-                cloud_in, params, max_points, max_octree_depth, min_octree_leaf);
-
-            std::vector<pcl_compress::patch_t> patches;
-            for (const auto& subset : decomp) {
-                pcl_compress::patch_t patch =
-                    pcl_compress::compute_patch(cloud_in, subset, img_size, blur_iters);
-                patches.push_back(patch);
+            scan.element_patches.resize(element_subsets.size());
+            for (uint32_t e = 0; e < element_subsets.size(); ++e) {
+                if (element_subsets[e].size() < 5) continue;
+                auto element_cloud = scan_subset(*cloud_in, element_subsets[e]);
+                subset_t().swap(element_subsets[e]);
+                uint32_t first = patches.size();
+                compute(element_cloud, patches, point_counts);
+                for (uint32_t i = first; i < patches.size(); ++i) {
+                    scan.element_patches[e].push_back(i);
+                }
             }
+            cloud_in.reset();
+        } else {
+            std::cout << "\tcomputing patches..." << "\n";
+            compute(cloud_in, patches, point_counts);
+        }
 
-            uint32_t last_index = blocks.empty() ? 0 : blocks.back().patch_indices.back();
-            block_info block;
-            block.type = block_type_t::scan;
-            block.patch_indices = std::vector<uint32_t>(patches.size(), 0);
-            std::iota(block.patch_indices.begin(), block.patch_indices.end(), last_index);
-            blocks.push_back(block);
+        std::cout << "\tcompressing..." << "\n";
+        scan.chunks = atlas_mode
+            ? encode_patch_images_atlas(patches, quality, atlas_size, scan.atlas_chunks)
+            : encode_patch_images(patches, quality);
+        append_scan_global_data(scan.gdata, scan.scan_index, origin, patches, point_counts);
+        if (use_checkpoints) {
+            save_checkpoint(checkpoint_path(checkpoint_dir, scan.scan_index), scan);
+        }
 
-            std::cout << "\tcompressing..." << "\n";
-            vec3f_t scan_origin = cloud_in->sensor_origin_.head(3);
-            pcl_compress::compressed_cloud_t::ptr_t cc = compress_patches(patches, quality, scan_idx, scan_origin);
+        if (progress) {
+            uint64_t bytes = 0;
+            for (const auto& chunk : scan.chunks) bytes += chunk.size();
+            for (const auto& chunk : scan.atlas_chunks) bytes += chunk.size();
+            progress->end_scan(scan.scan_index, scan_points, patches.size(), bytes);
+        }
+        append_scan(scan);
+    };
 
-            std::stringstream gcompr, gdata;
-            gcompr.write((const char*)cc->global_data.data(), cc->global_data.size());
-            gcompr.seekg(0);
-            pcl_compress::zlib_decompress_stream(gcompr, gdata);
-            gdata.seekg(0);
+    // scans with a valid checkpoint are neither loaded nor recomputed. Each
+    // checkpoint is read and verified once, here.
+    std::map<uint32_t, scan_checkpoint_t> restored;
+    if (resume) {
+        for (uint32_t i = 0; i < scan_count; ++i) {
+            scan_checkpoint_t scan;
+            if (load_checkpoint(checkpoint_path(checkpoint_dir, i), i, fingerprint, scan)) {
+                restored[i] = std::move(scan);
+            }
+        }
+        std::cout << "resuming, " << restored.size() << " of " << scan_count << " scans have valid checkpoints" << "\n";
+    }
+    auto next_pending = [&] (uint32_t scan_idx) {
+        while (scan_idx < scan_count && restored.count(scan_idx)) ++scan_idx;
+        return scan_idx;
+    };
 
-            pcl_compress::global_data_t parsed = pcl_compress::parse_global_data(gdata);
-            merged_gdata.scan_origins.push_back(parsed.scan_origin);
-            merged_gdata.scan_indices.push_back(parsed.scan_index);
-            merged_gdata.patch_counts.push_back(parsed.num_patches);
-            merged_gdata.bbs_o.push_back(parsed.bb_o);
-            merged_gdata.bbs_b.push_back(parsed.bb_b);
-            merged_gdata.point_counts.insert(merged_gdata.point_counts.end(), parsed.point_counts.begin(), parsed.point_counts.end());
-            merged_gdata.origins.insert(merged_gdata.origins.end(), parsed.origins.begin(), parsed.origins.end());
-            merged_gdata.bboxes.insert(merged_gdata.bboxes.end(), parsed.bboxes.begin(), parsed.bboxes.end());
-            merged_gdata.bases.insert(merged_gdata.bases.end(), parsed.bases.begin(), parsed.bases.end());
+    std::map<uint32_t, cloud_normal_t::Ptr> loaded;
+    std::map<uint32_t, compact_cloud::ptr_t> loaded_compact;
+    try {
+        for (uint32_t scan_idx = 0; scan_idx < scan_count; ++scan_idx) {
+            std::string guid;
+            scan_checkpoint_t scan;
+            scan.scan_index = scan_idx;
+            scan.fingerprint = fingerprint;
 
-            result.patch_image_data.insert(result.patch_image_data.end(), cc->patch_image_data.begin(), cc->patch_image_data.end());
+            std::cout << "processing scan " << scan_idx << "..." << "\n";
+            if (progress) progress->begin_scan(scan_idx);
+            auto found = restored.find(scan_idx);
+            if (found != restored.end()) {
+                std::cout << "\trestored from checkpoint" << "\n";
+                scan = std::move(found->second);
+                restored.erase(found);
+                uint64_t bytes = 0;
+                for (const auto& chunk : scan.chunks) bytes += chunk.size();
+                for (const auto& chunk : scan.atlas_chunks) bytes += chunk.size();
+                if (progress) progress->restore_scan(scan_idx, session->scan(scan_idx).point_count, scan.gdata.origins.size(), bytes);
+                append_scan(scan);
+                continue;
+            }
+
+            // scan_idx and the following pending scans up to the batch size
+            std::vector<uint32_t> batch;
+            for (uint32_t i = scan_idx; i < scan_count && batch.size() < std::max(load_batch, 1u); i = next_pending(i + 1)) {
+                batch.push_back(i);
+            }
+            if (compact) {
+                // loaded straight into the compact layout
+                if (!loaded_compact.count(scan_idx)) {
+                    for (const auto& idx : batch) {
+                        loaded_compact[idx] = session->load_compact(idx);
+                    }
+                }
+                compact_cloud::ptr_t cloud_in = loaded_compact[scan_idx];
+                loaded_compact.erase(scan_idx);
+                process_scan(cloud_in, compute_compact_patches, scan);
+                continue;
+            }
+            if (!loaded.count(scan_idx)) {
+                std::vector<cloud_normal_t::Ptr> clouds = session->load(batch, guid);
+                for (uint32_t i = 0; i < batch.size(); ++i) {
+                    loaded[batch[i]] = clouds[i];
+                }
+            }
+            cloud_normal_t::Ptr cloud_in = loaded[scan_idx];
+            loaded.erase(scan_idx);
+            process_scan(cloud_in, compute_patches, scan);
+        }
+    } catch (cancelled_error&) {
+        std::cerr << "Cancelled, no output written." << "\n";
+        if (use_checkpoints) {
+            std::cerr << "Completed scans are kept in \"" << checkpoint_dir << "\", rerun with --resume to continue." << "\n";
         }
+        if (progress) progress->cancel();
+        return 130;
+    }
+
+    result.patch_image_data.insert(result.patch_image_data.end(), atlas_chunks.begin(), atlas_chunks.end());
+
+    // one block per IFC element (across all scans) and one for the residual
+    for (uint32_t e = 0; e < element_patches.size(); ++e) {
+        if (element_patches[e].empty()) continue;
+        block_info block;
+        block.type = block_type_t::ifc_element;
+        block.ifc_guid = mesh->elements()[e].guid;
+        block.ifc_type = mesh->elements()[e].type;
+        block.patch_indices = element_patches[e];
+        blocks.push_back(block);
+    }
+    if (!residual_patches.empty()) {
+        block_info block;
+        block.type = block_type_t::residual;
+        block.patch_indices = residual_patches;
+        blocks.push_back(block);
     }
 
     // compress global data
-    std::stringstream gcompr;
-    pcl_compress::zlib_compress_object(merged_gdata, gcompr);
-    auto compr_length = gcompr.tellp();
-    result.global_data.resize(compr_length);
-    gcompr.seekg(0);
-    gcompr.read((char*)result.global_data.data(), compr_length);
+    if (legacy_gdata) {
+        std::stringstream gcompr;
+        pcl_compress::zlib_compress_object(merged_gdata, gcompr);
+        auto compr_length = gcompr.tellp();
+        result.global_data.resize(compr_length);
+        gcompr.seekg(0);
+        gcompr.read((char*)result.global_data.data(), compr_length);
+    } else {
+        encode_global_data(merged_gdata, result.global_data);
+    }
+
+    append_checksums(result);
+    std::cout << "archive checksum: " << std::hex << std::setw(8) << std::setfill('0') << archive_checksum(result) << std::dec << "\n";
 
     fs::path path_out(file_out);
     fs::path p_path = path_out.parent_path();
     if (p_path.string() != "" && !fs::exists(p_path)) {
         fs::create_directories(p_path);
     }
-    std::ofstream out(file_out.c_str());
-    if (!out.good()) {
-        std::cerr << "Unable to open file \"" << file_out << "\" for writing." << "\n";
+    uint64_t archive_bytes = 0;
+    try {
+        write_file_atomic(file_out, [&] (std::ostream& out) {
+            {
+                cereal::BinaryOutputArchive ar(out);
+                ar(result);
+            }
+            archive_bytes = out.tellp();
+        });
+    } catch (std::exception& e) {
+        std::cerr << e.what() << "\n";
         return 1;
     }
-    {
-        cereal::BinaryOutputArchive ar(out);
-        ar(result);
-    }
-    out.close();
-
 
     if (json) {
         fs::path path_json(file_json);
@@ -212,11 +562,25 @@ main(int argc, char const* argv[]) {
         if (p_path.string() != "" && !fs::exists(p_path)) {
             fs::create_directories(p_path);
         }
-        std::ofstream out(file_json.c_str());
-        {
-            cereal::JSONOutputArchive ar(out);
-            ar(cereal::make_nvp("blocks", blocks));
+        try {
+            write_file_atomic(file_json, [&] (std::ostream& out) {
+                cereal::JSONOutputArchive ar(out);
+                ar(cereal::make_nvp("blocks", blocks));
+            });
+        } catch (std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
         }
-        out.close();
     }
+
+    // the archive is complete, checkpoints are no longer needed
+    if (use_checkpoints) {
+        boost::system::error_code error;
+        for (uint32_t i = 0; i < scan_count; ++i) {
+            fs::remove(checkpoint_path(checkpoint_dir, i), error);
+        }
+        fs::remove(checkpoint_dir, error);
+    }
+
+    if (progress) progress->finish(archive_bytes);
 }
@@ -3,9 +3,15 @@
 #include <sstream>
 #include <fstream>
 #include <vector>
+#include <numeric>
+#include <algorithm>
+#include <iterator>
 #include <cstdio>
 #include <cstdlib>
 #include <sys/fcntl.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
@@ -19,64 +25,34 @@ namespace po = boost::program_options;
 #include <pcl_compress/zlib.hpp>
 #include <pcl_compress/types.hpp>
 #include <decomposition.hpp>
+#include <point_sink.hpp>
+#include <global_data.hpp>
+#include <patch_codec.hpp>
+#include <checksum.hpp>
+#include <cancellation.hpp>
+#include <archive.hpp>
 using namespace duraark_compress;
 using namespace pcl_compress;
 
-#include <e57_pcl/write.hpp>
-
 #include "block_info.hpp"
 
 
-std::vector<block_info> parse_json_blocks(const std::string& file_json, bool& has_entities, bool& has_scans) {
-    std::ifstream in(file_json.c_str());
-    std::vector<block_info> blocks;
-    {
-        cereal::JSONInputArchive ar(in);
-        ar(cereal::make_nvp("blocks", blocks));
-    }
-    in.close();
-
-    has_entities = false;
-    has_scans = false;
-    for (const auto& block : blocks) {
-        if (block.type == block_type_t::scan) {
-            has_scans = true;
-            continue;
-        }
-        if (block.type == block_type_t::ifc_element || block.type == block_type_t::residual) {
-            has_entities = true;
-            continue;
-        }
-    }
+// patches decoded and handed to the sink at once
+static const uint32_t batch_patches = 256;
 
-    return blocks;
-}
+// consecutive selected patches [begin, end) of a scan
+typedef struct patch_batch_ {
+    uint32_t scan;
+    uint32_t begin;
+    uint32_t end;
+} patch_batch_t;
 
-std::vector<uint32_t> gather_patch_indices(const std::vector<block_info>& blocks, const std::vector<uint32_t>& subset, const std::vector<std::string>& ifc_types) {
-    std::set<std::string> types(ifc_types.begin(), ifc_types.end());
-    std::set<uint32_t> sub(subset.begin(), subset.end());
-    bool skip_ifc = !types.size(), skip_scan = !sub.size();
-    uint32_t scan_idx = 0;
-    std::set<uint32_t> patches;
-    for (const auto& block : blocks) {
-        bool valid_block = false;
-        if (block.type == block_type_t::ifc_element && (skip_ifc || types.find(block.ifc_type) != types.end())) {
-            valid_block = true;
-        }
-        if (block.type == block_type_t::residual && (skip_ifc || types.find("residual") != types.end())) {
-            valid_block = true;
-        }
-        if (block.type == block_type_t::scan && (skip_scan || sub.find(scan_idx++) != sub.end())) {
-            valid_block = true;
-        }
-
-        if (!valid_block) continue;
-
-        patches.insert(block.patch_indices.begin(), block.patch_indices.end());
-    }
-
-    std::vector<uint32_t> result(patches.begin(), patches.end());
-    return result;
+cloud_normal_t::Ptr decompress_batch(const compressed_cloud_t& cc, const merged_global_data_t& global_data, const std::vector<uint32_t>& scan_patches, const patch_batch_t& batch) {
+    std::vector<uint32_t> patches(scan_patches.begin() + batch.begin, scan_patches.begin() + batch.end);
+    cloud_normal_t::Ptr cloud(new cloud_normal_t());
+    patch_decoder::local().decode_points(cc, global_data, patches, *cloud);
+    cloud->sensor_origin_.head(3) = global_data.scan_origins[batch.scan];
+    return cloud;
 }
 
 int
@@ -84,16 +60,22 @@ main(int argc, char const* argv[]) {
     std::string file_in;
     std::string file_json;
     std::string file_out;
+    std::string format;
     std::string scan_indices;
     std::vector<std::string> ifc_types;
+    uint32_t threads;
+    bool verify;
 
     po::options_description desc("jpeg2000_test command line options");
     desc.add_options()("help,h", "Help message")
         ("input-cloud,i", po::value<std::string>(&file_in)->required(), "E57n input file")
         ("input-json,j", po::value<std::string>(&file_json)->default_value(""), "Optional JSON metadata output file")
-        ("output,o", po::value<std::string>(&file_out)->required(), "Decompressed output E57n file")
+        ("output,o", po::value<std::string>(&file_out), "Decompressed output E57n file (required unless --verify is given)")
+        ("format,f", po::value<std::string>(&format)->default_value(""), "Output format: e57, ply or raw (Default: deduced from output file extension). Only ply and raw are written incrementally.")
         ("scan-indices,s", po::value<std::string>(&scan_indices)->default_value(""), "Indices string for scan subsets")
         ("ifc-types,t", po::value<std::vector<std::string>>(&ifc_types), "Indices string for scan subsets")
+        ("verify", po::bool_switch(&verify), "Only check the archive checksums, do not decompress")
+        ("threads", po::value<uint32_t>(&threads)->default_value(0), "Number of worker threads (Default: 0 => All cores)")
     ;
     po::positional_options_description p;
     p.add("ifc-types", -1);
@@ -117,28 +99,90 @@ main(int argc, char const* argv[]) {
         return optionsException ? 1 : 0;
     }
 
+    if (!verify && file_out == "") {
+        std::cerr << "No output file given. Aborting." << "\n";
+        return 1;
+    }
+
+#ifdef _OPENMP
+    if (threads) omp_set_num_threads(threads);
+#endif
+
+    install_cancel_handlers();
+
     fs::path path_in(file_in);
     if (!fs::exists(file_in)) {
         std::cerr << "Input E57c file \"" << file_in << "\" does not exist. Aborting." << "\n";
         return 1;
     }
 
-    std::vector<uint32_t> subset;
-    if (scan_indices != "") {
-        std::set<uint32_t> s_subset = parse_index_list_(scan_indices);
-        subset.assign(s_subset.begin(), s_subset.end());
-    }
     bool json = file_json != "" && fs::exists(fs::path(file_json));
 
-    if (!json && subset.size()) {
+    if (!json && scan_indices != "") {
         std::cerr << "Scan subsets can only be specified when a JSON is supplied. Aborting." << "\n";
         return 1;
     }
 
+    pcl_compress::compressed_cloud_t cc;
+    std::cout << "Reading compressed cloud" << "\n";
+    try {
+        cc = read_archive(file_in);
+    } catch (std::exception& e) {
+        std::cerr << e.what() << ". Aborting." << "\n";
+        return 1;
+    }
+
+    if (verify) {
+        if (!has_checksums(cc)) {
+            std::cerr << "Archive contains no checksums." << "\n";
+            return 1;
+        }
+        std::cout << "Verifying " << data_chunk_count(cc) << " chunks" << "\n";
+        verify_result_t check = verify_checksums(cc);
+        for (const auto& idx : check.corrupt_chunks) {
+            std::cout << "chunk " << idx << ": checksum mismatch" << "\n";
+        }
+        if (!check.global_data_ok) {
+            std::cout << "global data: checksum mismatch" << "\n";
+        }
+        if (!check.archive_ok) {
+            std::cout << "checksum table: checksum mismatch" << "\n";
+        }
+        bool ok = check.corrupt_chunks.empty() && check.global_data_ok && check.archive_ok;
+        std::cout << "archive checksum: " << std::hex << std::setw(8) << std::setfill('0') << archive_checksum(cc) << std::dec << "\n";
+        std::cout << (ok ? "OK" : "CORRUPT") << "\n";
+        return ok ? 0 : 1;
+    }
+
+    std::cout << "Decompressing global data" << "\n";
+    merged_global_data_t global_data;
+    try {
+        global_data = decode_global_data(cc.global_data);
+        validate_global_data(global_data, data_chunk_count(cc));
+    } catch (std::exception& e) {
+        std::cerr << e.what() << ". Aborting." << "\n";
+        return 1;
+    }
+
+    // index lists are checked against the archive before they are expanded
+    std::vector<uint32_t> subset;
+    if (scan_indices != "") {
+        subset = parse_index_list_(scan_indices, global_data.patch_counts.size());
+        if (subset.empty()) {
+            std::cerr << "Invalid scan index list \"" << scan_indices << "\" for " << global_data.patch_counts.size() << " scans. Aborting." << "\n";
+            return 1;
+        }
+    }
+
     bool has_entities = false, has_scans = false;
     std::vector<block_info> blocks;
     if (json) {
-        blocks = parse_json_blocks(file_json, has_entities, has_scans);
+        try {
+            blocks = parse_json_blocks(file_json, global_data.origins.size(), has_entities, has_scans);
+        } catch (std::exception& e) {
+            std::cerr << "Unable to parse JSON file \"" << file_json << "\": " << e.what() << ". Aborting." << "\n";
+            return 1;
+        }
     }
 
     if (subset.size() && !has_scans) {
@@ -152,41 +196,82 @@ main(int argc, char const* argv[]) {
     }
 
     std::vector<uint32_t> patches = gather_patch_indices(blocks, subset, ifc_types);
+    if (!json) {
+        patches.resize(global_data.origins.size());
+        std::iota(patches.begin(), patches.end(), 0);
+    }
 
-    pcl_compress::compressed_cloud_t cc;
-    std::cout << "Reading compressed cloud" << "\n";
-    std::ifstream in(file_in.c_str());
-    if (!in.good()) {
-        std::cerr << "Unable to open file \"" << file_in << "\" for reading." << "\n";
-        return 1;
+    // split selected patches into per-scan ranges using the patch counts
+    uint32_t scan_count = global_data.patch_counts.size();
+    std::vector<std::vector<uint32_t>> scan_patches(scan_count);
+    uint32_t scan_begin = 0, scan = 0;
+    for (const auto& idx : patches) {
+        while (scan < scan_count && idx >= scan_begin + global_data.patch_counts[scan]) {
+            scan_begin += global_data.patch_counts[scan++];
+        }
+        if (scan == scan_count) break;
+        scan_patches[scan].push_back(idx);
     }
-    {
-        cereal::BinaryInputArchive ar(in);
-        ar(cc);
+    uint32_t selected_scans = std::count_if(scan_patches.begin(), scan_patches.end(), [&] (const std::vector<uint32_t>& p) { return !p.empty(); });
+
+    point_sink::ptr_t sink;
+    try {
+        sink = make_point_sink(file_out, format, selected_scans);
+    } catch (std::exception& e) {
+        std::cerr << e.what() << " Aborting." << "\n";
+        return 1;
     }
-    in.close();
 
-    std::cout << "Decompressing global data" << "\n";
-    std::stringstream gcompr;
-    gcompr.write((const char*)cc.global_data.data(), cc.global_data.size());
-    gcompr.seekg(0);
-    merged_global_data_t global_data = zlib_decompress_object<merged_global_data_t>(gcompr);
+    // scans are streamed to the sink batch by batch, so only the batches in
+    // flight are held in memory
+    std::vector<patch_batch_t> batches;
+    for (uint32_t s = 0; s < scan_count; ++s) {
+        for (uint32_t begin = 0; begin < scan_patches[s].size(); begin += batch_patches) {
+            uint32_t end = std::min(begin + batch_patches, static_cast<uint32_t>(scan_patches[s].size()));
+            batches.push_back({s, begin, end});
+        }
+    }
 
-    std::cout << "Decompressing " << patches.size() << " patches" << "\n";
-    cloud_normal_t::Ptr global_cloud(new cloud_normal_t());
-    for (const auto& idx : patches) {
-        chunk_t occmap = cc.patch_image_data[idx*2+0];
-        chunk_t hmap = cc.patch_image_data[idx*2+1];
-        patch_t patch;
-        chunk_ptr_t chunk_jbig2(new chunk_t(occmap));
-        chunk_ptr_t chunk_jpeg2k(new chunk_t(hmap));
-        patch.origin = global_data.origins[idx];
-        patch.local_bbox = global_data.bboxes[idx];
-        patch.base = global_data.bases[idx];
-        patch.occ_map = jbig2_decompress_chunk(chunk_jbig2);
-        patch.height_map = jpeg2000_decompress_chunk(chunk_jpeg2k);
-        cloud_normal_t::Ptr cloud = from_patches({patch});
-        global_cloud->insert(global_cloud->end(), cloud->begin(), cloud->end());
-    }
-    e57_pcl::write_e57n(file_out, global_cloud, "some_GUID");
+    std::cout << "Decompressing " << patches.size() << " patches in " << selected_scans << " scans" << "\n";
+    // exceptions must not leave the parallel region, the first one is rethrown below
+    parallel_error error;
+    #pragma omp parallel for ordered schedule(dynamic, 1)
+    for (uint32_t b = 0; b < batches.size(); ++b) {
+        const patch_batch_t& batch = batches[b];
+        cloud_normal_t::Ptr batch_cloud;
+        if (!cancel_requested() && !error.failed()) {
+            try {
+                batch_cloud = decompress_batch(cc, global_data, scan_patches[batch.scan], batch);
+            } catch (...) {
+                error.capture();
+            }
+        }
+        #pragma omp ordered
+        if (batch_cloud && !cancel_requested() && !error.failed()) {
+            try {
+                if (batch.begin == 0) {
+                    sink->begin_scan(global_data.scan_indices[batch.scan], global_data.scan_origins[batch.scan]);
+                }
+                sink->write(batch_cloud);
+                if (batch.end == scan_patches[batch.scan].size()) {
+                    sink->end_scan();
+                }
+            } catch (...) {
+                error.capture();
+            }
+        }
+    }
+    if (cancel_requested() && !error.failed()) {
+        // unfinished sinks remove their temporary output
+        std::cerr << "Cancelled, no output written." << "\n";
+        return 130;
+    }
+    try {
+        error.rethrow();
+        sink->finish();
+    } catch (std::exception& e) {
+        // the sink removes its temporary output
+        std::cerr << e.what() << ". Aborting." << "\n";
+        return 1;
+    }
 }
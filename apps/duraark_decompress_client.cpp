@@ -0,0 +1,120 @@
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+
+#include <boost/program_options.hpp>
+namespace po = boost::program_options;
+
+#include <point_sink.hpp>
+#include <local_socket.hpp>
+using namespace duraark_compress;
+
+// points read per socket read
+static const uint32_t read_points = 1 << 16;
+
+cloud_normal_t::Ptr receive_scan(local_socket& server, const scan_header_t& header) {
+    cloud_normal_t::Ptr cloud(new cloud_normal_t());
+    cloud->sensor_origin_.head(3) = vec3f_t(header.origin[0], header.origin[1], header.origin[2]);
+    // the count is not trusted for the allocation, the data has to arrive first
+    cloud->reserve(std::min<uint64_t>(header.point_count, read_points));
+    std::vector<float> buffer;
+    for (uint64_t done = 0; done < header.point_count;) {
+        uint64_t count = std::min<uint64_t>(header.point_count - done, read_points);
+        buffer.resize(6 * count);
+        if (!server.read(buffer.data(), buffer.size() * sizeof(float))) {
+            throw std::runtime_error("Unexpected end of stream");
+        }
+        for (uint64_t i = 0; i < count; ++i) {
+            const float* v = &buffer[6 * i];
+            point_normal_t p;
+            p.x = v[0]; p.y = v[1]; p.z = v[2];
+            p.normal_x = v[3]; p.normal_y = v[4]; p.normal_z = v[5];
+            cloud->push_back(p);
+        }
+        done += count;
+    }
+    return cloud;
+}
+
+int
+main(int argc, char const* argv[]) {
+    std::string socket_path;
+    std::string file_out;
+    std::string format;
+    std::vector<std::string> request;
+
+    po::options_description desc("duraark_decompress_client command line options");
+    desc.add_options()("help,h", "Help message")
+        ("socket,S", po::value<std::string>(&socket_path)->default_value("/tmp/duraark_decompress.sock"), "UNIX domain socket of the server")
+        ("output,o", po::value<std::string>(&file_out)->default_value(""), "Optional output file for the received points")
+        ("format,f", po::value<std::string>(&format)->default_value(""), "Output format: e57, ply or raw (Default: deduced from output file extension)")
+        ("request", po::value<std::vector<std::string>>(&request)->required(), "Request, e.g. \"stats\" or \"<archive> [scan=0,3-5] [type=IfcWall,IfcSlab] [bbox=x0,y0,z0,x1,y1,z1]\"")
+    ;
+    po::positional_options_description p;
+    p.add("request", -1);
+
+    // Check for required options.
+    po::variables_map vm;
+    bool optionsException = false;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), vm);
+        po::notify(vm);
+    } catch (std::exception& e) {
+        if (!vm.count("help")) {
+            std::cout << e.what() << "\n";
+        }
+        optionsException = true;
+    }
+    if (optionsException || vm.count("help")) {
+        std::cout << desc << "\n";
+        return optionsException ? 1 : 0;
+    }
+
+    std::string line;
+    for (const auto& token : request) {
+        line += (line.empty() ? "" : " ") + token;
+    }
+
+    try {
+        local_socket::ptr_t server = local_socket::connect(socket_path);
+        server->write_line(line);
+
+        std::string reply;
+        if (!server->read_line(reply)) {
+            std::cerr << "Server closed the connection." << "\n";
+            return 1;
+        }
+        if (reply.compare(0, 3, "OK ") != 0) {
+            bool error = reply.compare(0, 4, "ERR ") == 0;
+            (error ? std::cerr : std::cout) << reply << "\n";
+            return error ? 1 : 0;
+        }
+        uint32_t scan_count = std::stoul(reply.substr(3));
+
+        point_sink::ptr_t sink;
+        if (file_out != "" && scan_count) {
+            sink = make_point_sink(file_out, format, scan_count);
+        }
+        uint64_t points = 0;
+        for (uint32_t s = 0; s < scan_count; ++s) {
+            scan_header_t header;
+            if (!server->read(&header, sizeof(header))) {
+                throw std::runtime_error("Unexpected end of stream");
+            }
+            cloud_normal_t::Ptr cloud = receive_scan(*server, header);
+            std::cout << "scan " << header.scan_index << ": " << cloud->size() << " points" << "\n";
+            points += cloud->size();
+            if (sink) {
+                sink->begin_scan(header.scan_index, cloud->sensor_origin_.head(3));
+                sink->write(cloud);
+                sink->end_scan();
+            }
+        }
+        if (sink) sink->finish();
+        std::cout << scan_count << " scans, " << points << " points" << "\n";
+    } catch (std::exception& e) {
+        std::cerr << e.what() << ". Aborting." << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,395 @@
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <cstdlib>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+namespace fs = boost::filesystem;
+namespace po = boost::program_options;
+
+#include <pcl_compress/decompress.hpp>
+#include <pcl_compress/types.hpp>
+#include <global_data.hpp>
+#include <patch_codec.hpp>
+#include <patch_cache.hpp>
+#include <cancellation.hpp>
+#include <archive.hpp>
+#include <local_socket.hpp>
+using namespace duraark_compress;
+using namespace pcl_compress;
+
+#include "block_info.hpp"
+
+// patches decoded in one parallel pass before their scans are sent
+static const uint32_t batch_patches = 1024;
+// points converted per socket write
+static const uint32_t write_points = 1 << 16;
+
+typedef struct served_archive_ {
+    std::string name;
+    archive_view::ptr_t view;
+    merged_global_data_t gdata;
+    std::vector<block_info> blocks;
+    bool has_entities;
+    /// First patch of every scan, followed by the patch count.
+    std::vector<uint32_t> scan_begins;
+    /// Radius of a sphere around the patch origin containing all its points,
+    /// independent of the orientation of the patch base.
+    std::vector<float> patch_radii;
+} served_archive_t;
+
+typedef struct query_ {
+    uint32_t archive;
+    std::vector<uint32_t> scans;
+    std::vector<std::string> ifc_types;
+    ex::optional<bbox3f_t> bbox;
+} query_t;
+
+served_archive_t load_archive(const std::string& file_in, const std::string& file_json) {
+    served_archive_t archive;
+    archive.name = fs::path(file_in).stem().string();
+    archive.view = std::make_shared<archive_view>(file_in);
+
+    chunk_t global_data;
+    archive.view->global_data(global_data);
+    archive.gdata = decode_global_data(global_data);
+    validate_global_data(archive.gdata, archive.view->data_chunk_count());
+    const merged_global_data_t& gdata = archive.gdata;
+
+    archive.has_entities = false;
+    if (file_json != "") {
+        bool has_scans;
+        try {
+            archive.blocks = parse_json_blocks(file_json, gdata.origins.size(), archive.has_entities, has_scans);
+        } catch (std::exception& e) {
+            throw std::runtime_error("Unable to parse JSON file \"" + file_json + "\": " + e.what());
+        }
+    }
+
+    archive.scan_begins.assign(1, 0);
+    for (const auto& count : gdata.patch_counts) {
+        archive.scan_begins.push_back(archive.scan_begins.back() + count);
+    }
+    if (archive.scan_begins.back() != gdata.origins.size()) {
+        throw std::runtime_error("Patch counts do not match the patches of the archive");
+    }
+
+    archive.patch_radii.resize(gdata.origins.size());
+    for (uint32_t i = 0; i < gdata.origins.size(); ++i) {
+        const bbox3f_t& bbox = gdata.bboxes[i];
+        archive.patch_radii[i] = bbox.min().cwiseAbs().cwiseMax(bbox.max().cwiseAbs()).norm();
+    }
+    return archive;
+}
+
+std::vector<float> parse_floats(std::string str) {
+    std::replace(str.begin(), str.end(), ',', ' ');
+    std::istringstream in(str);
+    std::vector<float> values;
+    float value;
+    while (in >> value) values.push_back(value);
+    if (!in.eof()) throw std::runtime_error("Invalid number list \"" + str + "\"");
+    return values;
+}
+
+/// Parses "<archive> [scan=0,3-5] [type=IfcWall,IfcSlab] [bbox=x0,y0,z0,x1,y1,z1]".
+query_t parse_query(const std::string& line, const std::vector<served_archive_t>& archives) {
+    std::istringstream in(line);
+    std::string token;
+    in >> token;
+
+    query_t query;
+    query.archive = archives.size();
+    for (uint32_t i = 0; i < archives.size(); ++i) {
+        if (archives[i].name == token) {
+            query.archive = i;
+            break;
+        }
+    }
+    if (query.archive == archives.size() && !token.empty() && token.find_first_not_of("0123456789") == std::string::npos && token.size() < 10) {
+        query.archive = std::stoul(token);
+    }
+    if (query.archive >= archives.size()) {
+        throw std::runtime_error("Unknown archive \"" + token + "\"");
+    }
+
+    while (in >> token) {
+        std::size_t split = token.find('=');
+        std::string key = token.substr(0, split);
+        std::string value = split == std::string::npos ? "" : token.substr(split + 1);
+        if (key == "scan") {
+            std::replace(value.begin(), value.end(), ',', ' ');
+            query.scans = parse_index_list_(value, archives[query.archive].gdata.patch_counts.size());
+            if (query.scans.empty()) throw std::runtime_error("Invalid scan index list \"" + value + "\"");
+        } else if (key == "type") {
+            std::istringstream types(value);
+            std::string type;
+            while (std::getline(types, type, ',')) {
+                if (!type.empty()) query.ifc_types.push_back(type);
+            }
+            if (query.ifc_types.empty()) throw std::runtime_error("Empty IFC type list");
+        } else if (key == "bbox") {
+            std::vector<float> v = parse_floats(value);
+            if (v.size() != 6) throw std::runtime_error("Bounding boxes need 6 coordinates");
+            bbox3f_t bbox(vec3f_t(v[0], v[1], v[2]), vec3f_t(v[3], v[4], v[5]));
+            if (bbox.isEmpty()) throw std::runtime_error("Empty bounding box");
+            query.bbox = bbox;
+        } else {
+            throw std::runtime_error("Unknown query parameter \"" + key + "\"");
+        }
+    }
+    return query;
+}
+
+/// Selected patches of every scan.
+std::vector<std::vector<uint32_t>> select_patches(const served_archive_t& archive, const query_t& query) {
+    const merged_global_data_t& gdata = archive.gdata;
+    uint32_t scan_count = gdata.patch_counts.size();
+
+    std::vector<uint32_t> patches;
+    if (query.ifc_types.size()) {
+        if (!archive.has_entities) {
+            throw std::runtime_error("IFC types specified but archive \"" + archive.name + "\" has no entity blocks");
+        }
+        patches = gather_patch_indices(archive.blocks, std::vector<uint32_t>(), query.ifc_types);
+    } else {
+        patches.resize(gdata.origins.size());
+        std::iota(patches.begin(), patches.end(), 0);
+    }
+
+    std::vector<bool> scan_selected(scan_count, query.scans.empty());
+    for (const auto& scan : query.scans) {
+        if (scan >= scan_count) {
+            throw std::runtime_error("Scan index " + std::to_string(scan) + " exceeds the " + std::to_string(scan_count) + " scans of archive \"" + archive.name + "\"");
+        }
+        scan_selected[scan] = true;
+    }
+
+    std::vector<std::vector<uint32_t>> scan_patches(scan_count);
+    for (const auto& idx : patches) {
+        uint32_t scan = std::upper_bound(archive.scan_begins.begin(), archive.scan_begins.end(), idx) - archive.scan_begins.begin() - 1;
+        if (!scan_selected[scan]) continue;
+        if (query.bbox && query.bbox->exteriorDistance(gdata.origins[idx]) > archive.patch_radii[idx]) continue;
+        scan_patches[scan].push_back(idx);
+    }
+    return scan_patches;
+}
+
+cloud_normal_t::ConstPtr decode_patch(const served_archive_t& archive, const chunk_source_t& source, uint32_t idx) {
+    thread_local std::vector<patch_t> batch(1);
+    const merged_global_data_t& gdata = archive.gdata;
+    patch_t& patch = batch[0];
+    patch.origin = gdata.origins[idx];
+    patch.local_bbox = gdata.bboxes[idx];
+    patch.base = gdata.bases[idx];
+    patch_decoder::local().decode_images(source, gdata.origins.size(), idx, patch);
+    return from_patches(batch);
+}
+
+/// Looks up the given patches in the cache and decodes the misses in parallel.
+std::vector<cloud_normal_t::ConstPtr> fetch_patches(const served_archive_t& archive, uint32_t archive_idx, const std::vector<uint32_t>& patches, patch_cache& cache) {
+    std::vector<cloud_normal_t::ConstPtr> clouds(patches.size());
+    std::vector<uint32_t> misses;
+    for (uint32_t i = 0; i < patches.size(); ++i) {
+        clouds[i] = cache.get(patch_cache::key_t(archive_idx, patches[i]));
+        if (!clouds[i]) misses.push_back(i);
+    }
+
+    chunk_source_t source = archive.view->source();
+    parallel_error error;
+    #pragma omp parallel for schedule(dynamic, 4)
+    for (uint32_t m = 0; m < misses.size(); ++m) {
+        if (cancel_requested() || error.failed()) continue;
+        uint32_t i = misses[m];
+        try {
+            try {
+                clouds[i] = decode_patch(archive, source, patches[i]);
+            } catch (std::exception& e) {
+                throw std::runtime_error("Unable to decode patch " + std::to_string(patches[i]) + ": " + e.what());
+            }
+            cache.put(patch_cache::key_t(archive_idx, patches[i]), clouds[i]);
+        } catch (...) {
+            error.capture();
+        }
+    }
+    error.rethrow();
+    checkpoint();
+    return clouds;
+}
+
+/// Sends the header and the points of one scan, returns the point count.
+uint64_t send_scan(local_socket& client, uint32_t scan_index, const vec3f_t& origin, const std::vector<cloud_normal_t::ConstPtr>& clouds, const ex::optional<bbox3f_t>& bbox) {
+    auto inside = [&] (const point_normal_t& p) { return !bbox || bbox->contains(p.getVector3fMap()); };
+
+    scan_header_t header;
+    header.scan_index = scan_index;
+    header.origin[0] = origin[0];
+    header.origin[1] = origin[1];
+    header.origin[2] = origin[2];
+    header.point_count = 0;
+    for (const auto& cloud : clouds) {
+        header.point_count += bbox ? std::count_if(cloud->begin(), cloud->end(), inside) : cloud->size();
+    }
+    client.write(&header, sizeof(header));
+
+    std::vector<float> buffer;
+    buffer.reserve(6 * write_points);
+    for (const auto& cloud : clouds) {
+        for (const auto& p : *cloud) {
+            if (!inside(p)) continue;
+            buffer.insert(buffer.end(), {p.x, p.y, p.z, p.normal_x, p.normal_y, p.normal_z});
+            if (buffer.size() == buffer.capacity()) {
+                client.write(buffer.data(), buffer.size() * sizeof(float));
+                buffer.clear();
+            }
+        }
+    }
+    client.write(buffer.data(), buffer.size() * sizeof(float));
+    return header.point_count;
+}
+
+void serve_query(const std::vector<served_archive_t>& archives, const std::string& line, patch_cache& cache, local_socket& client) {
+    query_t query;
+    std::vector<std::vector<uint32_t>> scan_patches;
+    try {
+        query = parse_query(line, archives);
+        scan_patches = select_patches(archives[query.archive], query);
+    } catch (std::exception& e) {
+        client.write_line(std::string("ERR ") + e.what());
+        return;
+    }
+    const served_archive_t& archive = archives[query.archive];
+
+    std::vector<uint32_t> scans;
+    for (uint32_t s = 0; s < scan_patches.size(); ++s) {
+        if (!scan_patches[s].empty()) scans.push_back(s);
+    }
+    client.write_line("OK " + std::to_string(scans.size()));
+
+    // decode consecutive scans together so small scans still keep all threads busy
+    uint64_t points = 0;
+    for (uint32_t begin = 0; begin < scans.size();) {
+        uint32_t end = begin;
+        std::vector<uint32_t> batch;
+        while (end < scans.size() && (end == begin || batch.size() < batch_patches)) {
+            const auto& p = scan_patches[scans[end++]];
+            batch.insert(batch.end(), p.begin(), p.end());
+        }
+        std::vector<cloud_normal_t::ConstPtr> clouds = fetch_patches(archive, query.archive, batch, cache);
+
+        auto first = clouds.begin();
+        for (uint32_t i = begin; i < end; ++i) {
+            uint32_t s = scans[i];
+            std::vector<cloud_normal_t::ConstPtr> scan_clouds(first, first + scan_patches[s].size());
+            first += scan_patches[s].size();
+            points += send_scan(client, archive.gdata.scan_indices[s], archive.gdata.scan_origins[s], scan_clouds, query.bbox);
+        }
+        begin = end;
+    }
+
+    patch_cache::stats_t stats = cache.stats();
+    std::cout << "\"" << line << "\": " << scans.size() << " scans, " << points << " points (cache: " << stats.entries << " patches, " << stats.bytes / (1 << 20) << " MiB, " << stats.hits << " hits, " << stats.misses << " misses)" << "\n";
+}
+
+void serve_client(const std::vector<served_archive_t>& archives, patch_cache& cache, local_socket& client) {
+    std::string line;
+    while (!cancel_requested() && client.read_line(line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+        if (line == "stats") {
+            patch_cache::stats_t stats = cache.stats();
+            client.write_line("STATS archives=" + std::to_string(archives.size()) + " entries=" + std::to_string(stats.entries) + " bytes=" + std::to_string(stats.bytes) + " hits=" + std::to_string(stats.hits) + " misses=" + std::to_string(stats.misses));
+            continue;
+        }
+        serve_query(archives, line, cache, client);
+    }
+}
+
+int
+main(int argc, char const* argv[]) {
+    std::vector<std::string> files_in;
+    std::vector<std::string> files_json;
+    std::string socket_path;
+    uint64_t cache_size;
+    uint32_t threads;
+
+    po::options_description desc("duraark_decompress_server command line options");
+    desc.add_options()("help,h", "Help message")
+        ("input-cloud,i", po::value<std::vector<std::string>>(&files_in)->required(), "E57c input files (may be given multiple times)")
+        ("input-json,j", po::value<std::vector<std::string>>(&files_json), "Optional JSON metadata files, matched to the input files by position (\"\" for none)")
+        ("socket,S", po::value<std::string>(&socket_path)->default_value("/tmp/duraark_decompress.sock"), "UNIX domain socket to listen on")
+        ("cache-size,c", po::value<uint64_t>(&cache_size)->default_value(1024), "Memory budget of the decoded patch cache in MiB")
+        ("threads", po::value<uint32_t>(&threads)->default_value(0), "Number of worker threads (Default: 0 => All cores)")
+    ;
+
+    // Check for required options.
+    po::variables_map vm;
+    bool optionsException = false;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+    } catch (std::exception& e) {
+        if (!vm.count("help")) {
+            std::cout << e.what() << "\n";
+        }
+        optionsException = true;
+    }
+    if (optionsException || vm.count("help")) {
+        std::cout << desc << "\n";
+        return optionsException ? 1 : 0;
+    }
+
+    if (files_json.size() > files_in.size()) {
+        std::cerr << "More JSON files than input files given. Aborting." << "\n";
+        return 1;
+    }
+    files_json.resize(files_in.size());
+
+#ifdef _OPENMP
+    if (threads) omp_set_num_threads(threads);
+#endif
+
+    install_cancel_handlers();
+
+    std::vector<served_archive_t> archives;
+    for (uint32_t i = 0; i < files_in.size(); ++i) {
+        try {
+            archives.push_back(load_archive(files_in[i], files_json[i]));
+        } catch (std::exception& e) {
+            std::cerr << "Unable to load archive \"" << files_in[i] << "\": " << e.what() << ". Aborting." << "\n";
+            return 1;
+        }
+        const served_archive_t& archive = archives.back();
+        std::cout << "Archive " << i << " \"" << archive.name << "\": " << archive.gdata.patch_counts.size() << " scans, " << archive.gdata.origins.size() << " patches" << "\n";
+    }
+
+    patch_cache cache(cache_size << 20);
+    local_socket::ptr_t server;
+    try {
+        server = local_socket::listen(socket_path);
+    } catch (std::exception& e) {
+        std::cerr << e.what() << ". Aborting." << "\n";
+        return 1;
+    }
+    std::cout << "Listening on \"" << socket_path << "\"" << "\n";
+
+    // clients are served one after another, each query is decoded in parallel
+    while (!cancel_requested()) {
+        local_socket::ptr_t client = server->accept(500);
+        if (!client) continue;
+        try {
+            serve_client(archives, cache, *client);
+        } catch (cancelled_error&) {
+            break;
+        } catch (std::exception& e) {
+            // the reply may be incomplete, dropping the connection tells the client
+            std::cerr << "Client error: " << e.what() << "\n";
+        }
+    }
+    std::cout << "Shutting down" << "\n";
+}
@@ -0,0 +1,25 @@
+###############################################################################
+# Find E57RefImpl (libE57 reference implementation)
+#
+# This sets the following variables:
+# E57REFIMPL_FOUND - True if E57RefImpl was found.
+# E57REFIMPL_INCLUDE_DIRS - Directories containing the E57RefImpl include files.
+# E57REFIMPL_LIBRARIES - E57RefImpl library files (including xerces-c).
+
+find_path(E57REFIMPL_INCLUDE_DIR e57/E57Foundation.h
+    HINTS "/usr/include" "/usr/local/include" "/usr/x86_64-w64-mingw32/include" "$ENV{PROGRAMFILES}")
+
+find_library(E57REFIMPL_LIBRARY NAMES E57RefImpl e57refimpl
+    HINTS "/usr/lib" "/usr/local/lib" "/usr/x86_64-w64-mingw32/lib")
+find_library(XERCES_LIBRARY NAMES xerces-c xerces-c_3
+    HINTS "/usr/lib" "/usr/local/lib" "/usr/x86_64-w64-mingw32/lib")
+
+set(E57REFIMPL_INCLUDE_DIRS ${E57REFIMPL_INCLUDE_DIR})
+set(E57REFIMPL_LIBRARIES ${E57REFIMPL_LIBRARY} ${XERCES_LIBRARY})
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(E57REFIMPL DEFAULT_MSG E57REFIMPL_INCLUDE_DIR E57REFIMPL_LIBRARY XERCES_LIBRARY)
+
+mark_as_advanced(E57REFIMPL_INCLUDE_DIR)
+mark_as_advanced(E57REFIMPL_LIBRARY)
+mark_as_advanced(XERCES_LIBRARY)
@@ -0,0 +1,88 @@
+// Fuzz target for the parsers reading untrusted input: scan index lists,
+// JSON block files and archives (including global data, patch selection
+// and patch decoding). The first input byte selects the parser, the rest is
+// its input. Built with -fsanitize=fuzzer it is a libFuzzer target, without
+// it reads its inputs from the files given on the command line (or stdin),
+// which is what AFL expects.
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <numeric>
+
+#include <pcl_compress/types.hpp>
+#include <archive.hpp>
+#include <checksum.hpp>
+#include <global_data.hpp>
+#include <patch_codec.hpp>
+using namespace duraark_compress;
+using namespace pcl_compress;
+
+#include "block_info.hpp"
+
+// keeps single runs fast, large archives are covered by duraark_stress
+static const uint32_t max_decoded_patches = 256;
+// patch and scan count assumed for index lists and JSON blocks
+static const uint32_t index_count = 1 << 16;
+
+void fuzz_index_list(const std::string& input) {
+    parse_index_list_(input, index_count);
+}
+
+void fuzz_json(const std::string& input) {
+    std::istringstream in(input);
+    bool has_entities, has_scans;
+    std::vector<block_info> blocks = parse_json_blocks(in, index_count, has_entities, has_scans);
+    gather_patch_indices(blocks, std::vector<uint32_t>(), std::vector<std::string>());
+    gather_patch_indices(blocks, {0, 2}, {"IfcWall", "residual"});
+}
+
+void fuzz_archive(const uint8_t* data, size_t size) {
+    compressed_cloud_t cc = read_archive(data, size, "fuzz input");
+    if (has_checksums(cc)) verify_checksums(cc);
+    merged_global_data_t gdata = decode_global_data(cc.global_data);
+    validate_global_data(gdata, data_chunk_count(cc));
+
+    std::vector<uint32_t> patches(std::min<uint64_t>(gdata.origins.size(), max_decoded_patches));
+    std::iota(patches.begin(), patches.end(), 0);
+    cloud_normal_t cloud;
+    patch_decoder::local().decode_points(cc, gdata, patches, cloud);
+    // atlases are cached by archive address, which the next input reuses
+    patch_decoder::local().clear_cache();
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (!size) return 0;
+    uint8_t target = data[0] % 3;
+    ++data;
+    --size;
+    try {
+        switch (target) {
+            case 0: fuzz_index_list(std::string(data, data + size)); break;
+            case 1: fuzz_json(std::string(data, data + size)); break;
+            default: fuzz_archive(data, size); break;
+        }
+    } catch (std::exception&) {
+        // rejecting input is fine, crashes, hangs and huge allocations are not
+    }
+    return 0;
+}
+
+#ifndef DURAARK_LIBFUZZER
+int
+main(int argc, char const* argv[]) {
+    std::vector<std::string> inputs(argv + 1, argv + argc);
+    if (inputs.empty()) inputs.push_back("");
+    for (const auto& input : inputs) {
+        std::ifstream file;
+        if (input != "") file.open(input.c_str(), std::ios::binary);
+        std::istream& in = input != "" ? file : std::cin;
+        if (!in) {
+            std::cerr << "Unable to open \"" << input << "\"" << "\n";
+            return 1;
+        }
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+}
+#endif
@@ -0,0 +1,122 @@
+// Generates large archives for stress tests by replicating the scans of an
+// existing archive (and its JSON blocks) a given number of times. Atlas
+// references, patch indices and scan indices are rebased per copy, so the
+// result decodes like a genuine archive with copies times the scans.
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+#include <boost/program_options.hpp>
+namespace po = boost::program_options;
+
+#include <pcl_compress/types.hpp>
+#include <archive.hpp>
+#include <atomic_file.hpp>
+#include <checksum.hpp>
+#include <global_data.hpp>
+#include <patch_codec.hpp>
+using namespace duraark_compress;
+using namespace pcl_compress;
+
+#include "block_info.hpp"
+
+int
+main(int argc, char const* argv[]) {
+    std::string file_in;
+    std::string file_json_in;
+    std::string file_out;
+    std::string file_json_out;
+    uint32_t copies;
+
+    po::options_description desc("duraark_stress command line options");
+    desc.add_options()("help,h", "Help message")
+        ("input-cloud,i", po::value<std::string>(&file_in)->required(), "Template E57c archive")
+        ("input-json,j", po::value<std::string>(&file_json_in)->default_value(""), "Optional JSON metadata of the template")
+        ("output,o", po::value<std::string>(&file_out)->required(), "Output E57c archive")
+        ("output-json,k", po::value<std::string>(&file_json_out)->default_value(""), "Output JSON metadata (requires --input-json)")
+        ("copies,n", po::value<uint32_t>(&copies)->default_value(10), "Number of copies of the template scans")
+    ;
+
+    // Check for required options.
+    po::variables_map vm;
+    bool optionsException = false;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+    } catch (std::exception& e) {
+        if (!vm.count("help")) {
+            std::cout << e.what() << "\n";
+        }
+        optionsException = true;
+    }
+    if (optionsException || vm.count("help")) {
+        std::cout << desc << "\n";
+        return optionsException ? 1 : 0;
+    }
+
+    if (file_json_out != "" && file_json_in == "") {
+        std::cerr << "JSON output requires a template JSON file. Aborting." << "\n";
+        return 1;
+    }
+
+    try {
+        compressed_cloud_t tpl = read_archive(file_in);
+        merged_global_data_t tpl_gdata = decode_global_data(tpl.global_data);
+        uint64_t data_chunks = data_chunk_count(tpl);
+        validate_global_data(tpl_gdata, data_chunks);
+        uint64_t patch_count = tpl_gdata.origins.size();
+        uint64_t atlas_count = data_chunks - 2 * patch_count;
+        uint32_t scan_index_offset = tpl_gdata.scan_indices.empty() ? 0 : *std::max_element(tpl_gdata.scan_indices.begin(), tpl_gdata.scan_indices.end()) + 1;
+        if ((patch_count + atlas_count) * copies > std::numeric_limits<uint32_t>::max()) {
+            std::cerr << "Too many copies. Aborting." << "\n";
+            return 1;
+        }
+
+        std::vector<block_info> tpl_blocks, blocks;
+        if (file_json_in != "") {
+            bool has_entities, has_scans;
+            tpl_blocks = parse_json_blocks(file_json_in, patch_count, has_entities, has_scans);
+        }
+
+        // all patch chunks first, then the atlases of all copies
+        compressed_cloud_t result;
+        merged_global_data_t gdata;
+        for (uint32_t c = 0; c < copies; ++c) {
+            merged_global_data_t copy = tpl_gdata;
+            for (auto& idx : copy.scan_indices) idx += c * scan_index_offset;
+            append_global_data(gdata, copy);
+
+            std::vector<chunk_t> chunks(tpl.patch_image_data.begin(), tpl.patch_image_data.begin() + 2 * patch_count);
+            rebase_atlas_references(chunks, c * atlas_count);
+            result.patch_image_data.insert(result.patch_image_data.end(), chunks.begin(), chunks.end());
+
+            for (auto block : tpl_blocks) {
+                for (auto& idx : block.patch_indices) idx += c * patch_count;
+                blocks.push_back(block);
+            }
+        }
+        for (uint32_t c = 0; c < copies; ++c) {
+            auto first = tpl.patch_image_data.begin() + 2 * patch_count;
+            result.patch_image_data.insert(result.patch_image_data.end(), first, first + atlas_count);
+        }
+        encode_global_data(gdata, result.global_data);
+        append_checksums(result);
+
+        write_file_atomic(file_out, [&] (std::ostream& out) {
+            cereal::BinaryOutputArchive ar(out);
+            ar(result);
+        });
+        if (file_json_out != "") {
+            write_file_atomic(file_json_out, [&] (std::ostream& out) {
+                cereal::JSONOutputArchive ar(out);
+                ar(cereal::make_nvp("blocks", blocks));
+            });
+        }
+        std::cout << gdata.patch_counts.size() << " scans, " << gdata.origins.size() << " patches, archive checksum " << std::hex << std::setw(8) << std::setfill('0') << archive_checksum(result) << std::dec << "\n";
+    } catch (std::exception& e) {
+        std::cerr << e.what() << ". Aborting." << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef DURAARK_COMPRESS_ARCHIVE_HPP_
+#define DURAARK_COMPRESS_ARCHIVE_HPP_
+
+#include <string>
+
+#include <pcl_compress/types.hpp>
+
+#include "common.hpp"
+#include "mapped_file.hpp"
+#include "patch_codec.hpp"
+
+namespace duraark_compress {
+
+/// Reads a compressed cloud as written by cereal::BinaryOutputArchive
+/// (global data, then the image chunks, every vector prefixed by its 64 bit
+/// length). Unlike the cereal loader, every length is checked against the
+/// remaining file size before anything is allocated, so truncated or
+/// corrupt archives fail with an exception instead of huge allocations.
+pcl_compress::compressed_cloud_t read_archive(const mapped_file& file);
+
+/// Same as above for an archive in memory, name is used in error messages.
+pcl_compress::compressed_cloud_t read_archive(const uint8_t* data,
+                                              uint64_t size,
+                                              const std::string& name);
+
+pcl_compress::compressed_cloud_t read_archive(const std::string& path);
+
+/// Memory mapped archive with an index of its chunks, checked like
+/// read_archive(). Chunks are copied out of the mapping on demand, so only
+/// the parts of the archive that are actually decoded are paged in.
+class archive_view {
+public:
+    typedef std::shared_ptr<archive_view> ptr_t;
+    typedef std::shared_ptr<const archive_view> const_ptr_t;
+
+public:
+    archive_view(const std::string& path);
+    virtual ~archive_view();
+
+    archive_view(const archive_view&) = delete;
+    archive_view& operator=(const archive_view&) = delete;
+
+    const mapped_file& file() const;
+
+    /// Number of image chunks, including an integrity chunk.
+    uint64_t chunk_count() const;
+
+    /// Number of image chunks not counting the integrity chunk.
+    uint64_t data_chunk_count() const;
+
+    void global_data(pcl_compress::chunk_t& chunk) const;
+
+    void chunk(uint64_t idx, pcl_compress::chunk_t& chunk) const;
+
+    /// Chunk source for patch_decoder, valid as long as this view.
+    chunk_source_t source() const;
+
+protected:
+    typedef std::pair<uint64_t, uint64_t> span_t;
+
+protected:
+    mapped_file file_;
+    span_t global_data_;
+    std::vector<span_t> chunks_;
+    uint64_t data_chunk_count_;
+};
+
+}  // duraark_compress
+
+#endif /* DURAARK_COMPRESS_ARCHIVE_HPP_ */
@@ -0,0 +1,28 @@
+#ifndef DURAARK_COMPRESS_ATOMIC_FILE_HPP_
+#define DURAARK_COMPRESS_ATOMIC_FILE_HPP_
+
+#include <functional>
+#include <ostream>
+#include <string>
+
+namespace duraark_compress {
+
+/// Temporary file name next to path, "<stem>.tmp-<pid><ext>". It lives in
+/// the same directory, so renaming it over path is atomic.
+std::string temporary_path(const std::string& path);
+
+/// Replaces path by the completed temporary file tmp.
+void commit_file(const std::string& tmp, const std::string& path);
+
+/// Removes tmp if it exists, ignoring errors.
+void discard_file(const std::string& tmp);
+
+/// Writes path through write() into a temporary file which is renamed to
+/// path once write() returned and the stream is good. On failure or
+/// exception the temporary is removed and path stays untouched.
+void write_file_atomic(const std::string& path,
+                       const std::function<void(std::ostream&)>& write);
+
+}  // duraark_compress
+
+#endif /* DURAARK_COMPRESS_ATOMIC_FILE_HPP_ */
@@ -2,13 +2,25 @@
 #define _DURAARK_COMPRESS_BLOCK_INFO_HPP_
 
 #include "common.hpp"
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <stdexcept>
 #include <boost/spirit/include/qi.hpp>
+#include <cereal/archives/json.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
 
 namespace duraark_compress {
 
 typedef enum class block_type_ : int { scan, ifc_element, residual, undefined } block_type_t;
 
-std::set<uint32_t> parse_index_list_(const std::string& str) {
+typedef std::vector<std::pair<uint32_t, uint32_t>> index_ranges_t;
+
+/// Parses index lists like "0 3-5 9" into their (inclusive) ranges without
+/// expanding them. Returns false for malformed input.
+inline bool parse_index_ranges_(const std::string& str, index_ranges_t& ranges) {
     using boost::spirit::qi::uint_;
     using boost::spirit::qi::char_;
     using boost::spirit::qi::phrase_parse;
@@ -17,13 +29,48 @@ std::set<uint32_t> parse_index_list_(const std::string& str) {
     auto first = str.begin();
     auto last = str.end();
     uint32_t index_begin = 0, index_end = 0;
-    std::set<uint32_t> indices;
+    ranges.clear();
     auto match_first = [&] (uint32_t idx) { index_begin = index_end = idx; };
     auto match_second = [&] (uint32_t idx) { index_end = idx; };
-    auto match_after = [&] () { for (uint32_t i=index_begin; i<=index_end; ++i) { indices.insert(i); }; };
+    auto match_after = [&] () { ranges.emplace_back(index_begin, index_end); };
     bool r = phrase_parse(first, last, *((uint_[match_first] >> -(char_('-') >> uint_[match_second]))[match_after]), space);
-    if (!r || first != last) {
-        return std::set<uint32_t>();
+    return r && first == last;
+}
+
+/// Expands ranges into sorted, unique indices. Returns false if an index is
+/// not below index_count or the ranges add up to more than max_count
+/// indices. Both are checked before anything is expanded, so the result
+/// never exceeds max_count entries.
+inline bool expand_index_ranges_(const index_ranges_t& ranges, uint64_t index_count, uint64_t max_count, std::vector<uint32_t>& indices) {
+    uint64_t count = 0;
+    for (const auto& range : ranges) {
+        if (range.first > range.second) continue;
+        if (range.second >= index_count) return false;
+        count += static_cast<uint64_t>(range.second) - range.first + 1;
+        if (count > max_count) return false;
+    }
+    indices.clear();
+    indices.reserve(count);
+    for (const auto& range : ranges) {
+        // 64 bit counter, range.second may be the largest uint32_t
+        for (uint64_t i = range.first; i <= range.second; ++i) {
+            indices.push_back(static_cast<uint32_t>(i));
+        }
+    }
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+    return true;
+}
+
+/// Parses index lists like "0 3-5 9" with indices below index_count.
+/// Returns an empty list for malformed input, for indices beyond
+/// index_count and for lists with more than index_count entries, which no
+/// list without repetitions has.
+inline std::vector<uint32_t> parse_index_list_(const std::string& str, uint64_t index_count) {
+    index_ranges_t ranges;
+    std::vector<uint32_t> indices;
+    if (!parse_index_ranges_(str, ranges) || !expand_index_ranges_(ranges, index_count, index_count, indices)) {
+        return std::vector<uint32_t>();
     }
     return indices;
 }
@@ -31,6 +78,9 @@ std::set<uint32_t> parse_index_list_(const std::string& str) {
 struct block_info {
     block_type_t type;
     std::vector<uint32_t> patch_indices;
+    // patch index list as loaded, expanded into patch_indices by
+    // parse_json_blocks once the patch count is known
+    index_ranges_t patch_ranges;
     std::string ifc_guid;
     std::string ifc_type;
 
@@ -57,13 +107,12 @@ struct block_info {
                 cons.back().push_back(idx);
             }
         }
-        bool not_first = false;
         indices_str.clear();
         for (const auto& c : cons) {
             if (!c.size()) continue;
-            if (not_first++) indices_str += " ";
+            if (!indices_str.empty()) indices_str += " ";
             indices_str += std::to_string(c[0]);
-            if (c.size() > 2) indices_str += "-" + std::to_string(c.back());
+            if (c.size() > 1) indices_str += "-" + std::to_string(c.back());
         }
         ar(cereal::make_nvp("patch_indices", indices_str));
 
@@ -78,8 +127,10 @@ struct block_info {
 
         std::string indices_str;
         ar(cereal::make_nvp("patch_indices", indices_str));
-        std::set<uint32_t> iset = parse_index_list_(indices_str);
-        patch_indices = std::vector<uint32_t>(iset.begin(), iset.end());
+        if (!parse_index_ranges_(indices_str, patch_ranges)) {
+            throw std::runtime_error("Invalid patch index list \"" + indices_str.substr(0, 64) + "\"");
+        }
+        patch_indices.clear();
 
         if (type_string == "scan") {
             type = block_type_t::scan;
@@ -93,6 +144,85 @@ struct block_info {
     }
 };
 
+/// Reads the block list of JSON metadata for an archive of patch_count
+/// patches and reports which kinds of blocks it contains. Throws if a block
+/// references a patch beyond patch_count or the blocks list more than
+/// 2 * patch_count indices in total (every patch belongs to one scan block
+/// and at most one entity block).
+inline std::vector<block_info> parse_json_blocks(std::istream& in, uint64_t patch_count, bool& has_entities, bool& has_scans) {
+    std::vector<block_info> blocks;
+    {
+        cereal::JSONInputArchive ar(in);
+        ar(cereal::make_nvp("blocks", blocks));
+    }
+
+    uint64_t budget = 2 * patch_count;
+    for (auto& block : blocks) {
+        if (!expand_index_ranges_(block.patch_ranges, patch_count, budget, block.patch_indices)) {
+            throw std::runtime_error("Patch index list exceeds the " + std::to_string(patch_count) + " patches of the archive");
+        }
+        budget -= block.patch_indices.size();
+        block.patch_ranges.clear();
+    }
+
+    has_entities = false;
+    has_scans = false;
+    for (const auto& block : blocks) {
+        if (block.type == block_type_t::scan) {
+            has_scans = true;
+            continue;
+        }
+        if (block.type == block_type_t::ifc_element || block.type == block_type_t::residual) {
+            has_entities = true;
+            continue;
+        }
+    }
+
+    return blocks;
+}
+
+inline std::vector<block_info> parse_json_blocks(const std::string& file_json, uint64_t patch_count, bool& has_entities, bool& has_scans) {
+    std::ifstream in(file_json.c_str());
+    return parse_json_blocks(in, patch_count, has_entities, has_scans);
+}
+
+/// Returns the sorted patch indices of the scan blocks in subset and the
+/// entity blocks of the given IFC types. Empty filters select everything.
+inline std::vector<uint32_t> gather_patch_indices(const std::vector<block_info>& blocks, const std::vector<uint32_t>& subset, const std::vector<std::string>& ifc_types) {
+    std::set<std::string> types(ifc_types.begin(), ifc_types.end());
+    std::set<uint32_t> sub(subset.begin(), subset.end());
+    bool skip_ifc = !types.size(), skip_scan = !sub.size();
+    bool has_scans = false, has_entities = false;
+    uint32_t scan_idx = 0;
+    std::set<uint32_t> scan_patches, entity_patches;
+    for (const auto& block : blocks) {
+        if (block.type == block_type_t::scan) {
+            has_scans = true;
+            if (skip_scan || sub.find(scan_idx++) != sub.end()) {
+                scan_patches.insert(block.patch_indices.begin(), block.patch_indices.end());
+            }
+        }
+        if (block.type == block_type_t::ifc_element || block.type == block_type_t::residual) {
+            has_entities = true;
+            std::string type = block.type == block_type_t::residual ? "residual" : block.ifc_type;
+            if (skip_ifc || types.find(type) != types.end()) {
+                entity_patches.insert(block.patch_indices.begin(), block.patch_indices.end());
+            }
+        }
+    }
+
+    // scan and entity blocks cover the same patches, combine both filters
+    std::vector<uint32_t> result;
+    if (has_scans && has_entities) {
+        std::set_intersection(scan_patches.begin(), scan_patches.end(), entity_patches.begin(), entity_patches.end(), std::back_inserter(result));
+    } else if (has_scans) {
+        result.assign(scan_patches.begin(), scan_patches.end());
+    } else {
+        result.assign(entity_patches.begin(), entity_patches.end());
+    }
+    return result;
+}
+
 } // duraark_compress
 
 #endif /* _DURAARK_COMPRESS_BLOCK_INFO_HPP_ */
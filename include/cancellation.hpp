@@ -0,0 +1,57 @@
+#ifndef DURAARK_COMPRESS_CANCELLATION_HPP_
+#define DURAARK_COMPRESS_CANCELLATION_HPP_
+
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+
+namespace duraark_compress {
+
+/// Thrown by checkpoint() once cancellation has been requested.
+class cancelled_error : public std::runtime_error {
+public:
+    cancelled_error();
+};
+
+/// Requests cooperative cancellation. Async-signal-safe.
+void request_cancel();
+
+bool cancel_requested();
+
+/// Cancellation point. Throws cancelled_error if cancellation was requested.
+/// Must not be called inside OpenMP regions; parallel loops skip their
+/// remaining iterations if cancel_requested() and call checkpoint() after
+/// the loop.
+void checkpoint();
+
+/// First exception thrown by the iterations of a parallel loop. Exceptions
+/// must not leave an OpenMP region (the process terminates), so iterations
+/// catch everything, capture() it and the loop skips its remaining
+/// iterations if failed(). rethrow() after the loop.
+class parallel_error {
+public:
+    parallel_error();
+
+    bool failed() const;
+
+    /// Keeps the current exception if it is the first one. Call from a catch
+    /// block only.
+    void capture();
+
+    /// Rethrows the captured exception, if any.
+    void rethrow() const;
+
+protected:
+    std::atomic<bool> failed_;
+    std::exception_ptr error_;
+    std::mutex mutex_;
+};
+
+/// Makes SIGINT and SIGTERM request cancellation. A second signal
+/// terminates the process immediately.
+void install_cancel_handlers();
+
+}  // duraark_compress
+
+#endif /* DURAARK_COMPRESS_CANCELLATION_HPP_ */
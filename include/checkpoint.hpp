@@ -0,0 +1,50 @@
+#ifndef DURAARK_COMPRESS_CHECKPOINT_HPP_
+#define DURAARK_COMPRESS_CHECKPOINT_HPP_
+
+#include <string>
+
+#include <pcl_compress/types.hpp>
+
+#include "common.hpp"
+
+namespace duraark_compress {
+
+/// Everything a compression run keeps of one scan. Patch indices and atlas
+/// ids are relative to the scan, so a checkpoint can be appended to an
+/// archive regardless of which scans were recomputed before it.
+typedef struct scan_checkpoint_ {
+    uint32_t scan_index;
+    /// Fingerprint of input and parameters the scan was compressed with.
+    uint32_t fingerprint;
+    /// Global table entries of this scan only.
+    pcl_compress::merged_global_data_t gdata;
+    /// Two chunks per patch.
+    std::vector<pcl_compress::chunk_t> chunks;
+    std::vector<pcl_compress::chunk_t> atlas_chunks;
+    /// Patches per IFC element, the last entry holds the residual patches.
+    /// Empty if not compressed in IFC mode.
+    std::vector<std::vector<uint32_t>> element_patches;
+
+    template <class Archive>
+    void
+    serialize(Archive& ar) {
+        ar(scan_index, fingerprint, gdata, chunks, atlas_chunks,
+           element_patches);
+    }
+} scan_checkpoint_t;
+
+/// "<dir>/scan_<index>.ckpt"
+std::string checkpoint_path(const std::string& dir, uint32_t scan_index);
+
+/// Writes checkpoint atomically, guarded by a CRC32C of its contents.
+void save_checkpoint(const std::string& path,
+                     const scan_checkpoint_t& checkpoint);
+
+/// Loads a checkpoint. Returns false if the file is missing, corrupt,
+/// truncated or belongs to another scan or fingerprint.
+bool load_checkpoint(const std::string& path, uint32_t scan_index,
+                     uint32_t fingerprint, scan_checkpoint_t& checkpoint);
+
+}  // duraark_compress
+
+#endif /* DURAARK_COMPRESS_CHECKPOINT_HPP_ */
@@ -0,0 +1,47 @@
+#ifndef DURAARK_COMPRESS_CHECKSUM_HPP_
+#define DURAARK_COMPRESS_CHECKSUM_HPP_
+
+#include <pcl_compress/types.hpp>
+
+#include "common.hpp"
+
+namespace duraark_compress {
+
+/// CRC32C (Castagnoli) of size bytes, continuing from crc.
+uint32_t crc32c(const void* data, std::size_t size, uint32_t crc = 0);
+
+/// Result of verify_checksums().
+typedef struct verify_result_ {
+    bool global_data_ok;
+    bool archive_ok;
+    /// Indices (into patch_image_data) of chunks failing their checksum.
+    std::vector<uint32_t> corrupt_chunks;
+} verify_result_t;
+
+/// Appends the integrity chunk to cc.patch_image_data. It holds the
+/// CRC32C of the global data, of every other chunk and of the archive (the
+/// CRC32C over all these checksums). It has to be the last chunk and is
+/// ignored by readers that do not know it.
+void append_checksums(pcl_compress::compressed_cloud_t& cc);
+
+/// True if chunk is a valid integrity chunk for an archive of chunk_count
+/// chunks (including the integrity chunk itself).
+bool is_checksum_chunk(const pcl_compress::chunk_t& chunk,
+                       uint64_t chunk_count);
+
+/// True if the last chunk of cc is an integrity chunk.
+bool has_checksums(const pcl_compress::compressed_cloud_t& cc);
+
+/// Number of chunks not counting the integrity chunk.
+uint32_t data_chunk_count(const pcl_compress::compressed_cloud_t& cc);
+
+/// Archive checksum stored in the integrity chunk. Throws if there is none.
+uint32_t archive_checksum(const pcl_compress::compressed_cloud_t& cc);
+
+/// Recomputes all checksums in parallel and compares them against the
+/// integrity chunk. Throws if there is none.
+verify_result_t verify_checksums(const pcl_compress::compressed_cloud_t& cc);
+
+}  // duraark_compress
+
+#endif /* DURAARK_COMPRESS_CHECKSUM_HPP_ */
@@ -0,0 +1,82 @@
+#ifndef DURAARK_COMPRESS_COMPACT_CLOUD_HPP_
+#define DURAARK_COMPRESS_COMPACT_CLOUD_HPP_
+
+#include <pcl/register_point_struct.h>
+
+#include "common.hpp"
+
+namespace duraark_compress {
+
+/// Minimal point type handed to the primitive detector (32 instead of 48
+/// bytes, no curvature).
+struct EIGEN_ALIGN16 point_detect_t {
+    PCL_ADD_POINT4D;
+    PCL_ADD_NORMAL4D;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+typedef pcl::PointCloud<point_detect_t> cloud_detect_t;
+
+/// Structure-of-arrays point cloud with float coordinates and octahedral
+/// encoded normals (16 bytes per point instead of 48 for pcl::PointNormal).
+class compact_cloud {
+public:
+    typedef std::shared_ptr<compact_cloud> ptr_t;
+    typedef std::shared_ptr<const compact_cloud> const_ptr_t;
+
+public:
+    compact_cloud();
+    compact_cloud(const cloud_normal_t& cloud);
+    /// Copies the given points of cloud (with the same sensor origin).
+    compact_cloud(const compact_cloud& cloud, const std::vector<int>& subset);
+    virtual ~compact_cloud();
+
+    uint32_t size() const;
+    bool empty() const;
+
+    void reserve(uint32_t count);
+    void push_back(const vec3f_t& point, const vec3f_t& normal);
+
+    /// Reorders the points, order[i] is the index of the point that moves
+    /// to position i. Points are gathered in parallel.
+    void permute(const std::vector<uint32_t>& order);
+
+    vec3f_t point(uint32_t idx) const;
+    vec3f_t normal(uint32_t idx) const;
+
+    const vec3f_t& sensor_origin() const;
+    void set_sensor_origin(const vec3f_t& origin);
+
+    /// Returns the bounding box of all points.
+    bbox3f_t bounding_box() const;
+
+    /// Materializes the given points as a new cloud with indices 0..n-1.
+    cloud_normal_t::Ptr extract(const std::vector<int>& subset) const;
+
+    /// Same as above, reusing the storage of cloud.
+    void extract(const std::vector<int>& subset, cloud_normal_t& cloud) const;
+
+    /// Materializes the given points (all points if subset is empty).
+    template <typename PointT>
+    typename pcl::PointCloud<PointT>::Ptr
+    to_cloud(const std::vector<int>& subset = std::vector<int>()) const;
+
+protected:
+    std::vector<float> x_;
+    std::vector<float> y_;
+    std::vector<float> z_;
+    std::vector<uint32_t> normals_;
+    vec3f_t sensor_origin_;
+};
+
+}  // duraark_compress
+
+POINT_CLOUD_REGISTER_POINT_STRUCT(duraark_compress::point_detect_t,
+                                  (float, x, x)
+                                  (float, y, y)
+                                  (float, z, z)
+                                  (float, normal_x, normal_x)
+                                  (float, normal_y, normal_y)
+                                  (float, normal_z, normal_z))
+
+#endif /* DURAARK_COMPRESS_COMPACT_CLOUD_HPP_ */
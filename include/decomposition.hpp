@@ -22,6 +22,15 @@ typedef struct prim_detect_params_ {
     float bitmap_epsilon;
     float min_area;
     float probability_threshold;
+    // if tile_size > 0 planes are detected in parallel on overlapping xy
+    // tiles of this size and merged afterwards
+    float tile_size;
+    float tile_overlap;
+    // if max_height_deviation > 0 plane quadtrees split by planarity, see
+    // quadtree::params_t
+    float max_height_deviation;
+    float flat_cell_factor;
+    bool merge_flat_cells;
 } prim_detect_params_t;
 
 template <typename PointT>
@@ -34,6 +43,20 @@ decomposition_t primitive_decomposition(
     decomposition_t* primitive_sets = nullptr,
     uint32_t* primitive_patches = nullptr);
 
+class compact_cloud;
+
+/// Same as above, operating on the compact cloud layout. Primitives are
+/// always detected on xy tiles (sized automatically if tile_size <= 0), so
+/// only the detector input of the tiles in flight and the residual points
+/// are temporarily materialized.
+decomposition_t primitive_decomposition(
+    const compact_cloud& cloud,
+    const prim_detect_params_t& prim_params,
+    uint32_t max_points_per_cell,
+    uint32_t max_depth,
+    float residual_leaf_size,
+    decomposition_t* primitive_sets = nullptr,
+    uint32_t* primitive_patches = nullptr);
 
 }  // duraark_compress
 
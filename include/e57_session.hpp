@@ -0,0 +1,72 @@
+#ifndef DURAARK_COMPRESS_E57_SESSION_HPP_
+#define DURAARK_COMPRESS_E57_SESSION_HPP_
+
+#include <functional>
+#include <string>
+
+#include "common.hpp"
+
+namespace duraark_compress {
+
+class compact_cloud;
+
+/// Single-open view of an E57 file. One libE57 reader is kept open for the
+/// whole session; the scan table (scan count, record counts, stored fields)
+/// is read from it once on construction and every scan is decoded through
+/// it, so neither the file nor its XML section are parsed again per scan.
+class e57_session {
+public:
+    typedef std::shared_ptr<e57_session> ptr_t;
+
+    typedef struct scan_info_ {
+        uint64_t point_count;
+        bool has_normals;
+    } scan_info_t;
+
+    /// Receives the points of a scan in blocks, transformed by the scan
+    /// pose. Invalid records are skipped.
+    typedef std::function<void(const std::vector<vec3f_t>& points,
+                               const std::vector<vec3f_t>& normals)>
+        block_func_t;
+
+public:
+    e57_session(const std::string& path);
+    virtual ~e57_session();
+
+    e57_session(const e57_session&) = delete;
+    e57_session& operator=(const e57_session&) = delete;
+
+    const std::string& path() const;
+    const std::string& guid() const;
+
+    uint32_t scan_count() const;
+    const scan_info_t& scan(uint32_t idx) const;
+
+    /// Loads the given scans one after another. guid receives the file GUID.
+    /// Scans without stored normals are loaded by e57_pcl, which estimates
+    /// them.
+    std::vector<cloud_normal_t::Ptr> load(const std::vector<uint32_t>& scans,
+                                          std::string& guid) const;
+
+    /// Loads scan idx straight into the compact layout, without an
+    /// intermediate pcl cloud. Scans without stored normals are loaded by
+    /// e57_pcl and converted.
+    std::shared_ptr<compact_cloud> load_compact(uint32_t idx) const;
+
+    /// Decodes scan idx block by block and returns its sensor origin (the
+    /// translation of the scan pose). Throws if the scan has no normals.
+    vec3f_t read(uint32_t idx, const block_func_t& append) const;
+
+protected:
+    struct e57_file_;
+
+protected:
+    std::string path_;
+    std::unique_ptr<e57_file_> file_;
+    std::string guid_;
+    std::vector<scan_info_t> scans_;
+};
+
+}  // duraark_compress
+
+#endif /* DURAARK_COMPRESS_E57_SESSION_HPP_ */
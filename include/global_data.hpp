@@ -0,0 +1,46 @@
+#ifndef DURAARK_COMPRESS_GLOBAL_DATA_HPP_
+#define DURAARK_COMPRESS_GLOBAL_DATA_HPP_
+
+#include <pcl_compress/types.hpp>
+
+#include "common.hpp"
+
+namespace duraark_compress {
+
+/// Compact encoding of the merged global data table.
+///
+/// Patch origins and local bounding boxes are stored as 20 bit fixed point
+/// values relative to the per-scan bounds bbs_o and bbs_b (which are
+/// extended to contain every value), bases as an octahedral encoded normal
+/// plus a 16 bit rotation angle around it. All integers are delta and
+/// varint coded and the resulting stream is deflated. The chunk starts with
+/// the magic "DGD2" so it can be told apart from the legacy format (zlib
+/// compressed cereal archive).
+void encode_global_data(const pcl_compress::merged_global_data_t& gdata,
+                        pcl_compress::chunk_t& chunk);
+
+/// Decodes the compact and the legacy global data format.
+pcl_compress::merged_global_data_t decode_global_data(
+    const pcl_compress::chunk_t& chunk);
+
+bool is_compact_global_data(const pcl_compress::chunk_t& chunk);
+
+/// Throws if the per-scan and per-patch tables of gdata disagree in size or
+/// if there are not two image chunks for every patch.
+void validate_global_data(const pcl_compress::merged_global_data_t& gdata,
+                          uint64_t chunk_count);
+
+/// Appends the table entries of one scan. bbs_o/bbs_b receive the bounding
+/// boxes of the patch origins and of the local patch bounding boxes.
+void append_scan_global_data(pcl_compress::merged_global_data_t& gdata,
+                             uint32_t scan_index, const vec3f_t& scan_origin,
+                             const std::vector<pcl_compress::patch_t>& patches,
+                             const std::vector<uint32_t>& point_counts);
+
+/// Appends all scans of other.
+void append_global_data(pcl_compress::merged_global_data_t& gdata,
+                        const pcl_compress::merged_global_data_t& other);
+
+}  // duraark_compress
+
+#endif /* DURAARK_COMPRESS_GLOBAL_DATA_HPP_ */
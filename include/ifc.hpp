@@ -0,0 +1,61 @@
+#ifndef DURAARK_COMPRESS_IFC_HPP_
+#define DURAARK_COMPRESS_IFC_HPP_
+
+#include <array>
+#include <string>
+
+#include <Eigen/StdVector>
+
+#include "common.hpp"
+
+namespace duraark_compress {
+
+typedef std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f>>
+    transforms_t;
+
+typedef struct ifc_element_ {
+    std::string guid;
+    std::string type;
+} ifc_element_t;
+
+/// Triangulated IFC geometry as exported to Wavefront OBJ.
+/// Every group/object ("g"/"o" statement) is one IFC element. Names of the
+/// form "<IfcType>_<GUID>" (e.g. "IfcWall_2O2Fr$t4X7Zf8NOew3FLOH") provide
+/// both type and GUID, any other name is taken as GUID of an element of
+/// unknown type.
+class ifc_mesh {
+public:
+    typedef std::shared_ptr<ifc_mesh> ptr_t;
+    typedef std::shared_ptr<const ifc_mesh> const_ptr_t;
+
+    typedef struct face_ {
+        std::array<uint32_t, 3> vertices;
+        uint32_t element;
+    } face_t;
+
+public:
+    static ptr_t load_obj(const std::string& file_obj);
+    virtual ~ifc_mesh();
+
+    const std::vector<ifc_element_t>& elements() const;
+    const std::vector<vec3f_t>& vertices() const;
+    const std::vector<face_t>& faces() const;
+
+protected:
+    ifc_mesh();
+
+protected:
+    std::vector<ifc_element_t> elements_;
+    std::vector<vec3f_t> vertices_;
+    std::vector<face_t> faces_;
+};
+
+/// Reads scan-to-IFC transformations from a registration RDF file.
+/// Every literal consisting of exactly 16 numbers is read as a row-major
+/// 4x4 matrix, in order of appearance (one per scan). A file containing a
+/// single matrix applies it to all scans.
+transforms_t load_registration(const std::string& file_reg);
+
+}  // duraark_compress
+
+#endif /* DURAARK_COMPRESS_IFC_HPP_ */
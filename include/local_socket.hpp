@@ -0,0 +1,71 @@
+#ifndef DURAARK_COMPRESS_LOCAL_SOCKET_HPP_
+#define DURAARK_COMPRESS_LOCAL_SOCKET_HPP_
+
+#include <string>
+
+#include "common.hpp"
+
+namespace duraark_compress {
+
+/// Header of the points of one scan in a query reply of the decompression
+/// server. The reply starts with the line "OK <scan count>", every scan is
+/// a scan_header_t followed by point_count records of 6 floats (position
+/// and normal). Failed queries are answered by a single line
+/// "ERR <message>".
+typedef struct scan_header_ {
+    uint32_t scan_index;
+    float origin[3];
+    uint64_t point_count;
+} scan_header_t;
+
+/// UNIX domain stream socket, either listening on a path or connected.
+/// Reads are buffered so lines and binary data can be mixed.
+class local_socket {
+public:
+    typedef std::shared_ptr<local_socket> ptr_t;
+
+public:
+    /// Listens on path, replacing a stale socket file (one that refuses
+    /// connections). Throws if path is any other file or a live socket. The
+    /// file is removed again when the socket is destroyed.
+    static ptr_t listen(const std::string& path);
+
+    static ptr_t connect(const std::string& path);
+
+    local_socket(int fd, const std::string& owned_path = "");
+    virtual ~local_socket();
+
+    local_socket(const local_socket&) = delete;
+    local_socket& operator=(const local_socket&) = delete;
+
+    /// Waits at most timeout_ms for a client. Returns a null pointer on
+    /// timeout or when interrupted by a signal, so callers can poll for
+    /// cancellation.
+    ptr_t accept(int timeout_ms);
+
+    /// Writes all bytes, throws if the peer is gone.
+    void write(const void* data, uint64_t size);
+
+    void write_line(const std::string& line);
+
+    /// Reads exactly size bytes. Returns false if the stream ends before the
+    /// first byte, throws if it ends in between.
+    bool read(void* data, uint64_t size);
+
+    /// Reads a line without its '\n'. Returns false at the end of the
+    /// stream, throws for lines longer than max_length.
+    bool read_line(std::string& line, uint64_t max_length = 1 << 16);
+
+protected:
+    bool fill_();
+
+protected:
+    int fd_;
+    std::string owned_path_;
+    std::vector<char> buffer_;
+    uint64_t buffer_begin_;
+};
+
+}  // duraark_compress
+
+#endif /* DURAARK_COMPRESS_LOCAL_SOCKET_HPP_ */
@@ -0,0 +1,36 @@
+#ifndef DURAARK_COMPRESS_MAPPED_FILE_HPP_
+#define DURAARK_COMPRESS_MAPPED_FILE_HPP_
+
+#include <string>
+
+#include "common.hpp"
+
+namespace duraark_compress {
+
+/// Read-only memory mapping of a whole file.
+class mapped_file {
+public:
+    typedef std::shared_ptr<mapped_file> ptr_t;
+    typedef std::shared_ptr<const mapped_file> const_ptr_t;
+
+public:
+    mapped_file(const std::string& path);
+    virtual ~mapped_file();
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const std::string& path() const;
+    const uint8_t* data() const;
+    uint64_t size() const;
+
+protected:
+    std::string path_;
+    int fd_;
+    const uint8_t* data_;
+    uint64_t size_;
+};
+
+}  // duraark_compress
+
+#endif /* DURAARK_COMPRESS_MAPPED_FILE_HPP_ */
@@ -0,0 +1,40 @@
+#ifndef DURAARK_COMPRESS_OCTAHEDRAL_HPP_
+#define DURAARK_COMPRESS_OCTAHEDRAL_HPP_
+
+#include "common.hpp"
+
+namespace duraark_compress {
+
+/// Octahedral unit vector encoding: the vector is projected onto the
+/// octahedron |x|+|y|+|z| = 1, the lower half is folded over the upper one and
+/// both resulting coordinates in [-1,1] are quantized to 16 bit each.
+inline uint32_t
+oct_encode(const vec3f_t& v) {
+    vec3f_t n = v / (std::fabs(v[0]) + std::fabs(v[1]) + std::fabs(v[2]));
+    vec2f_t p = n.head(2);
+    if (n[2] < 0.f) {
+        p = vec2f_t((1.f - std::fabs(n[1])) * (n[0] >= 0.f ? 1.f : -1.f),
+                    (1.f - std::fabs(n[0])) * (n[1] >= 0.f ? 1.f : -1.f));
+    }
+    auto quantize = [] (float c) {
+        float clamped = std::min(1.f, std::max(-1.f, c));
+        return static_cast<uint32_t>(std::round((clamped * 0.5f + 0.5f) * 65535.f));
+    };
+    return quantize(p[0]) | (quantize(p[1]) << 16);
+}
+
+inline vec3f_t
+oct_decode(uint32_t code) {
+    vec2f_t p(static_cast<float>(code & 0xffff) / 65535.f * 2.f - 1.f,
+              static_cast<float>(code >> 16) / 65535.f * 2.f - 1.f);
+    vec3f_t n(p[0], p[1], 1.f - std::fabs(p[0]) - std::fabs(p[1]));
+    if (n[2] < 0.f) {
+        n.head(2) = vec2f_t((1.f - std::fabs(p[1])) * (p[0] >= 0.f ? 1.f : -1.f),
+                            (1.f - std::fabs(p[0])) * (p[1] >= 0.f ? 1.f : -1.f));
+    }
+    return n.normalized();
+}
+
+}  // duraark_compress
+
+#endif /* DURAARK_COMPRESS_OCTAHEDRAL_HPP_ */
@@ -0,0 +1,59 @@
+#ifndef DURAARK_COMPRESS_PATCH_CACHE_HPP_
+#define DURAARK_COMPRESS_PATCH_CACHE_HPP_
+
+#include <list>
+#include <map>
+#include <mutex>
+
+#include "common.hpp"
+
+namespace duraark_compress {
+
+/// Least recently used cache of decoded patch points, bounded by the memory
+/// of the cached points. Entries are shared, so evicting a patch does not
+/// invalidate points still in use by a caller. Thread-safe.
+class patch_cache {
+public:
+    typedef std::shared_ptr<patch_cache> ptr_t;
+    /// Archive and patch index.
+    typedef std::pair<uint32_t, uint32_t> key_t;
+
+    typedef struct stats_ {
+        uint64_t entries;
+        uint64_t bytes;
+        uint64_t hits;
+        uint64_t misses;
+    } stats_t;
+
+public:
+    patch_cache(uint64_t byte_budget);
+    virtual ~patch_cache();
+
+    /// Returns the cached points or a null pointer on a miss.
+    cloud_normal_t::ConstPtr get(const key_t& key);
+
+    /// Inserts points and evicts the least recently used entries exceeding
+    /// the budget. Patches larger than the whole budget are not cached.
+    void put(const key_t& key, cloud_normal_t::ConstPtr points);
+
+    stats_t stats() const;
+
+protected:
+    typedef std::pair<key_t, cloud_normal_t::ConstPtr> entry_t;
+
+    static uint64_t bytes_(const cloud_normal_t& points);
+
+protected:
+    mutable std::mutex mutex_;
+    uint64_t budget_;
+    uint64_t bytes_used_;
+    uint64_t hits_;
+    uint64_t misses_;
+    // most recently used first
+    std::list<entry_t> entries_;
+    std::map<key_t, std::list<entry_t>::iterator> index_;
+};
+
+}  // duraark_compress
+
+#endif /* DURAARK_COMPRESS_PATCH_CACHE_HPP_ */
@@ -0,0 +1,152 @@
+#ifndef DURAARK_COMPRESS_PATCH_CODEC_HPP_
+#define DURAARK_COMPRESS_PATCH_CODEC_HPP_
+
+#include <functional>
+#include <list>
+#include <map>
+
+#include <pcl_compress/types.hpp>
+
+#include "common.hpp"
+
+namespace duraark_compress {
+
+/// Encodes the occupancy (JBIG2) and height map (JPEG2000) of every patch
+/// into two consecutive chunks. Constant images - fully occupied occupancy
+/// maps and flat height maps are common for quadtree leaves on planar
+/// walls - are stored as small marker chunks and never reach the codecs.
+/// Images are encoded in parallel, which requires the pcl_compress encoders
+/// to keep their codec state per call. The first codec exception is
+/// rethrown once the parallel loop has finished.
+std::vector<pcl_compress::chunk_t> encode_patch_images(
+    const std::vector<pcl_compress::patch_t>& patches, uint32_t quality);
+
+/// Atlas variant of encode_patch_images. Non-constant images of equal size
+/// and type are tiled into square atlases of at most atlas_size pixels,
+/// which are encoded once each and appended to atlas_chunks. The per-patch
+/// chunks then only reference a rectangle of an atlas. Atlas ids count
+/// globally, so atlas_chunks may be shared by consecutive calls; the atlas
+/// chunks have to follow all patch chunks in the final archive. Height maps
+/// are tiled with a gutter of replicated edge pixels; the encoded atlas is
+/// decoded again and height maps whose PSNR in the atlas falls below quality
+/// are encoded on their own instead.
+std::vector<pcl_compress::chunk_t> encode_patch_images_atlas(
+    const std::vector<pcl_compress::patch_t>& patches, uint32_t quality,
+    uint32_t atlas_size, std::vector<pcl_compress::chunk_t>& atlas_chunks);
+
+/// Random access to the image chunks of an archive that is not held in a
+/// compressed_cloud_t. count is the number of data chunks (patch and atlas
+/// chunks, without a trailing checksum chunk). fetch copies chunk idx
+/// (< count) into its second argument, key identifies the archive in the
+/// atlas cache.
+typedef struct chunk_source_ {
+    const void* key;
+    uint64_t count;
+    std::function<void(uint64_t, pcl_compress::chunk_t&)> fetch;
+} chunk_source_t;
+
+/// Reusable decoding state. The codec input and fetch buffers keep their
+/// capacity between calls, and so do the patches of a decode_points() batch:
+/// constant images and atlas rectangles are written into the storage of the
+/// previous image if size and type match. Images produced by the JBIG2 and
+/// JPEG2000 decoders are allocated by pcl_compress, which sets up a new
+/// codec per image and offers no way to reuse it or decode into given
+/// storage. Recently decoded atlases are cached. Use local() to obtain the
+/// instance of the calling thread.
+class patch_decoder {
+public:
+    static patch_decoder& local();
+
+    patch_decoder();
+    virtual ~patch_decoder();
+
+    /// Decodes the image pair of a patch, skipping the codecs for constant
+    /// images. Atlas references can not be resolved without the archive and
+    /// throw.
+    void decode_images(const pcl_compress::chunk_t& occ_chunk,
+                       const pcl_compress::chunk_t& height_chunk,
+                       pcl_compress::patch_t& patch);
+
+    /// Decodes the image pair of patch idx of cc, resolving atlas references.
+    /// patch_count is the total number of patches in cc.
+    void decode_images(const pcl_compress::compressed_cloud_t& cc,
+                       uint32_t patch_count, uint32_t idx,
+                       pcl_compress::patch_t& patch);
+
+    /// Same as above, fetching the chunks of patch idx from source.
+    void decode_images(const chunk_source_t& source, uint32_t patch_count,
+                       uint32_t idx, pcl_compress::patch_t& patch);
+
+    /// Decodes the given patches and appends their points to cloud. Patches
+    /// are converted to points in batches of batch_size.
+    void decode_points(const pcl_compress::compressed_cloud_t& cc,
+                       const pcl_compress::merged_global_data_t& gdata,
+                       const std::vector<uint32_t>& patches,
+                       cloud_normal_t& cloud, uint32_t batch_size = 64);
+
+    /// Drops cached atlases. The cache is keyed by the archive address (or
+    /// the source key), call this before an archive is replaced by another
+    /// one at the same address.
+    void clear_cache();
+
+protected:
+    void decode_image_(const pcl_compress::chunk_t& chunk,
+                       const chunk_source_t* source, uint32_t patch_count,
+                       bool occupancy, const cv::Size& size, cv::Mat& img);
+
+    cv::Mat decode_codec_(const pcl_compress::chunk_t& chunk, bool occupancy);
+
+    cv::Mat decode_buffer_(bool occupancy);
+
+    const cv::Mat& atlas_(const chunk_source_t& source, uint64_t chunk_idx,
+                          bool occupancy);
+
+    static chunk_source_t source_(const pcl_compress::compressed_cloud_t& cc);
+
+protected:
+    pcl_compress::chunk_ptr_t occ_buffer_;
+    pcl_compress::chunk_ptr_t height_buffer_;
+    pcl_compress::chunk_t fetched_;
+    std::vector<pcl_compress::patch_t> batch_;
+    // patches of larger earlier batches, kept for their image storage
+    std::vector<pcl_compress::patch_t> spare_;
+    std::map<uint64_t, cv::Mat> atlases_;
+    // cached atlas chunk indices, most recently used first
+    std::list<uint64_t> atlas_order_;
+    const void* atlas_source_;
+};
+
+/// Shorthand for patch_decoder::local().decode_images().
+void decode_patch_images(const pcl_compress::chunk_t& occ_chunk,
+                         const pcl_compress::chunk_t& height_chunk,
+                         pcl_compress::patch_t& patch);
+
+/// Returns true and sets value if all pixels of img are equal.
+bool is_constant_image(const cv::Mat& img, double& value);
+
+/// Marker chunk for a constant image: tag, rows, cols, OpenCV type, value.
+void encode_constant_chunk(const cv::Mat& img, double value,
+                           pcl_compress::chunk_t& chunk);
+
+/// Returns false if chunk is not a constant marker chunk. Throws for
+/// image types patches never use, for absurd sizes and, if size is not
+/// empty, for images of another size.
+bool decode_constant_chunk(const pcl_compress::chunk_t& chunk, cv::Mat& img,
+                           const cv::Size& size = cv::Size());
+
+/// Adds offset to the atlas id of every atlas reference in chunks, used to
+/// append atlases encoded with their own (zero based) atlas list.
+void rebase_atlas_references(std::vector<pcl_compress::chunk_t>& chunks,
+                             uint32_t offset);
+
+/// Atlas reference chunk: tag, atlas id and the rectangle of the image.
+void encode_atlas_reference(uint32_t atlas, const cv::Rect& rect,
+                            pcl_compress::chunk_t& chunk);
+
+/// Returns false if chunk is not an atlas reference chunk.
+bool decode_atlas_reference(const pcl_compress::chunk_t& chunk,
+                            uint32_t& atlas, cv::Rect& rect);
+
+}  // duraark_compress
+
+#endif /* DURAARK_COMPRESS_PATCH_CODEC_HPP_ */
@@ -0,0 +1,109 @@
+#ifndef DURAARK_COMPRESS_POINT_SINK_HPP_
+#define DURAARK_COMPRESS_POINT_SINK_HPP_
+
+#include <deque>
+#include <fstream>
+#include <string>
+
+#include "common.hpp"
+
+namespace duraark_compress {
+
+/// Destination for decompressed points.
+/// Points are handed to the sink as soon as they are decoded, enclosed in
+/// begin_scan()/end_scan() calls; streaming sinks write them out immediately
+/// so the decoder never holds the full cloud.
+class point_sink {
+public:
+    typedef std::shared_ptr<point_sink> ptr_t;
+
+public:
+    virtual ~point_sink();
+
+    virtual void begin_scan(uint32_t scan_index, const vec3f_t& scan_origin);
+    virtual void write(cloud_normal_t::ConstPtr cloud) = 0;
+    virtual void end_scan();
+    virtual void finish() = 0;
+
+    uint64_t point_count() const;
+
+protected:
+    uint64_t point_count_ = 0;
+};
+
+/// Streaming sink writing float x, y, z, nx, ny, nz records. Output goes to
+/// a temporary file which replaces file_out on finish(); it is removed if the
+/// sink is destroyed unfinished.
+class file_sink : public point_sink {
+public:
+    file_sink(const std::string& file_out);
+    virtual ~file_sink();
+
+    void write(cloud_normal_t::ConstPtr cloud);
+
+protected:
+    void commit_();
+
+protected:
+    std::string file_out_;
+    std::string file_tmp_;
+    std::ofstream out_;
+};
+
+/// Binary little endian PLY with float x, y, z, nx, ny, nz vertices.
+/// The vertex count is patched into the header on finish().
+class ply_sink : public file_sink {
+public:
+    ply_sink(const std::string& file_out);
+    virtual ~ply_sink();
+
+    void finish();
+
+protected:
+    std::streampos count_pos_;
+};
+
+/// Headerless sequence of float x, y, z, nx, ny, nz records.
+class raw_sink : public file_sink {
+public:
+    raw_sink(const std::string& file_out);
+    virtual ~raw_sink();
+
+    void finish();
+};
+
+/// E57n output. e57_pcl can only write complete clouds, so this sink buffers
+/// one scan at a time. In split mode every scan is written to its own file
+/// "<stem>_scan<index><ext>" with its sensor origin, otherwise all points are
+/// written to file_out on finish(). Files are written to temporary names
+/// and all of them are renamed on finish(); they are removed if the sink is
+/// destroyed unfinished.
+class e57_sink : public point_sink {
+public:
+    e57_sink(const std::string& file_out, bool split_scans);
+    virtual ~e57_sink();
+
+    void begin_scan(uint32_t scan_index, const vec3f_t& scan_origin);
+    void write(cloud_normal_t::ConstPtr cloud);
+    void end_scan();
+    void finish();
+
+protected:
+    std::string file_out_;
+    bool split_scans_;
+    uint32_t scan_index_;
+    cloud_normal_t::Ptr cloud_;
+    // written temporary files and their final names
+    std::deque<std::pair<std::string, std::string>> pending_;
+};
+
+/// Creates a sink for format "e57", "ply" or "raw". An empty format is deduced
+/// from the file extension (".ply", ".raw"/".bin", everything else is E57).
+/// E57 output is split per scan if more than one scan will be written.
+point_sink::ptr_t make_point_sink(const std::string& file_out,
+                                  std::string format = "",
+                                  uint32_t scan_count = 1);
+
+}  // duraark_compress
+
+#endif /* DURAARK_COMPRESS_POINT_SINK_HPP_ */
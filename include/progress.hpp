@@ -0,0 +1,63 @@
+#ifndef DURAARK_COMPRESS_PROGRESS_HPP_
+#define DURAARK_COMPRESS_PROGRESS_HPP_
+
+#include <chrono>
+#include <ostream>
+#include <string>
+
+#include "common.hpp"
+
+namespace duraark_compress {
+
+/// Emits the progress of a compression run as JSON lines, one object per
+/// event:
+///
+///   {"event":"scan_done","scan":3,"scans_done":4,"scan_count":100,
+///    "points_done":..,"points_total":..,"patches":..,"bytes":..,
+///    "elapsed":12.5,"eta":301.2}
+///
+/// Events are "start", "scan_begin", "scan_done", "scan_restored",
+/// "finished" and "cancelled". The ETA (in seconds) extrapolates the
+/// throughput in points of the computed scans and is null until the first
+/// scan has been computed. Scans restored from checkpoints count as done but
+/// are excluded from the throughput, as is the time spent restoring them.
+class progress_reporter {
+public:
+    typedef std::shared_ptr<progress_reporter> ptr_t;
+
+public:
+    progress_reporter(std::ostream& out, uint32_t scan_count,
+                      uint64_t total_points);
+    virtual ~progress_reporter();
+
+    void begin_scan(uint32_t scan);
+    void end_scan(uint32_t scan, uint64_t points, uint32_t patches,
+                  uint64_t bytes);
+    void restore_scan(uint32_t scan, uint64_t points, uint32_t patches,
+                      uint64_t bytes);
+    void finish(uint64_t bytes);
+    void cancel();
+
+protected:
+    void add_scan_(uint64_t points, uint32_t patches, uint64_t bytes);
+    void emit_(const char* event, int64_t scan);
+
+protected:
+    std::ostream& out_;
+    std::chrono::steady_clock::time_point start_;
+    std::chrono::steady_clock::time_point scan_start_;
+    // time spent on restored scans
+    double restore_time_;
+    uint32_t scan_count_;
+    uint32_t scans_done_;
+    uint64_t total_points_;
+    uint64_t points_done_;
+    uint32_t scans_computed_;
+    uint64_t points_computed_;
+    uint64_t patches_;
+    uint64_t bytes_;
+};
+
+}  // duraark_compress
+
+#endif /* DURAARK_COMPRESS_PROGRESS_HPP_ */
@@ -13,9 +13,21 @@ public:
     typedef std::shared_ptr<quadtree> ptr_t;
     typedef std::shared_ptr<const quadtree> cptr_t;
 
+    /// Cells split while they hold more than max_points_per_cell points.
+    /// If heights (distances of the points to their plane) are given and
+    /// max_height_deviation > 0, the limit adapts to the planarity of the
+    /// cell: cells whose height standard deviation stays within
+    /// max_height_deviation may hold flat_cell_factor times as many points,
+    /// all others are split down to max_points_per_cell / flat_cell_factor.
+    /// With merge_flat_cells, flat sibling leaves are merged as long as the
+    /// merged cell is flat and within the flat limit. Only siblings that
+    /// cover a rectangle together (adjacent pairs or all four) are merged.
     typedef struct params_ {
         uint32_t max_depth;
         uint32_t max_points_per_cell;
+        float max_height_deviation;
+        float flat_cell_factor;
+        bool merge_flat_cells;
     } params_t;
 
     class node;
@@ -25,7 +37,8 @@ public:
     typedef std::shared_ptr<const node> node_cptr_t;
 
 public:
-    quadtree(const std::vector<vec2f_t>& points, const params_t& params);
+    quadtree(const std::vector<vec2f_t>& points, const params_t& params,
+             const std::vector<float>* heights = nullptr);
     virtual ~quadtree();
 
     node_iterator nodes_begin();
@@ -51,7 +64,10 @@ public:
 
 public:
     node(const bbox2f_t& bbox, const std::vector<vec2f_t>& points,
-         const indices_t& subset, const params_t& params, uint32_t depth = 0);
+         const indices_t& subset, const params_t& params, uint32_t depth = 0,
+         const std::vector<float>* heights = nullptr);
+    /// Leaf node holding subset.
+    node(const bbox2f_t& bbox, const indices_t& subset);
     virtual ~node();
 
     indices_t& indices();
@@ -64,6 +80,12 @@ protected:
     static bool inside_(uint32_t quadrant, const vec2f_t& point,
                         const vec2f_t& center);
 
+    static float deviation_(const std::vector<float>& heights,
+                            const indices_t& subset);
+
+    void merge_flat_children_(const std::vector<float>& heights,
+                              const params_t& params);
+
 protected:
     std::vector<ptr_t> children_;
     bbox2f_t bbox_;
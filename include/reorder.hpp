@@ -0,0 +1,27 @@
+#ifndef DURAARK_COMPRESS_REORDER_HPP_
+#define DURAARK_COMPRESS_REORDER_HPP_
+
+#include "common.hpp"
+
+namespace duraark_compress {
+
+class compact_cloud;
+
+/// Permutation sorting the points of cloud along a Morton (Z-order) curve
+/// over their bounding box, 21 bits per axis. order[i] is the index of the
+/// point that moves to position i. Codes are computed and sorted in
+/// parallel.
+std::vector<uint32_t> morton_order(const cloud_normal_t& cloud);
+
+/// Reorders the points of cloud by order. Points are gathered in parallel,
+/// so the pages of the new point array are first touched by the threads
+/// working on them.
+void apply_order(cloud_normal_t& cloud, const std::vector<uint32_t>& order);
+
+/// Same as above for the compact cloud layout.
+std::vector<uint32_t> morton_order(const compact_cloud& cloud);
+void apply_order(compact_cloud& cloud, const std::vector<uint32_t>& order);
+
+}  // duraark_compress
+
+#endif /* DURAARK_COMPRESS_REORDER_HPP_ */
@@ -0,0 +1,49 @@
+#ifndef DURAARK_COMPRESS_TRIANGLE_BVH_HPP_
+#define DURAARK_COMPRESS_TRIANGLE_BVH_HPP_
+
+#include "common.hpp"
+#include "ifc.hpp"
+
+namespace duraark_compress {
+
+/// Bounding volume hierarchy over the faces of an IFC mesh for closest
+/// face queries.
+class triangle_bvh {
+public:
+    typedef std::shared_ptr<triangle_bvh> ptr_t;
+
+    typedef struct hit_ {
+        uint32_t face;
+        float distance;
+    } hit_t;
+
+public:
+    triangle_bvh(ifc_mesh::const_ptr_t mesh, uint32_t max_leaf_size = 4);
+    virtual ~triangle_bvh();
+
+    /// Closest face within max_distance of point, if any.
+    ex::optional<hit_t> closest(const vec3f_t& point, float max_distance) const;
+
+protected:
+    typedef struct node_ {
+        bbox3f_t bbox;
+        uint32_t begin;
+        uint32_t end;
+        int32_t left;
+        int32_t right;
+    } node_t;
+
+    int32_t build_(uint32_t begin, uint32_t end);
+    float squared_distance_(const vec3f_t& point, uint32_t face) const;
+
+protected:
+    ifc_mesh::const_ptr_t mesh_;
+    uint32_t max_leaf_size_;
+    std::vector<uint32_t> faces_;
+    std::vector<vec3f_t> centroids_;
+    std::vector<node_t> nodes_;
+};
+
+}  // duraark_compress
+
+#endif /* DURAARK_COMPRESS_TRIANGLE_BVH_HPP_ */
@@ -0,0 +1,148 @@
+#include <archive.hpp>
+
+#include <cstring>
+
+#include <checksum.hpp>
+
+namespace duraark_compress {
+
+using pcl_compress::chunk_t;
+
+typedef std::pair<uint64_t, uint64_t> span_t;
+
+// archive bytes, from a mapping or from memory
+typedef struct bytes_ {
+    const uint8_t* data;
+    uint64_t size;
+    const std::string& name;
+} bytes_t;
+
+static uint64_t
+read_length_(const bytes_t& bytes, uint64_t& offset) {
+    uint64_t length;
+    if (bytes.size - offset < sizeof(uint64_t)) {
+        throw std::runtime_error("Truncated archive \"" + bytes.name + "\"");
+    }
+    std::memcpy(&length, bytes.data + offset, sizeof(uint64_t));
+    offset += sizeof(uint64_t);
+    return length;
+}
+
+static span_t
+read_span_(const bytes_t& bytes, uint64_t& offset) {
+    uint64_t length = read_length_(bytes, offset);
+    if (bytes.size - offset < length) {
+        throw std::runtime_error("Truncated archive \"" + bytes.name + "\"");
+    }
+    span_t span(offset, length);
+    offset += length;
+    return span;
+}
+
+static void
+index_archive_(const bytes_t& bytes, span_t& global_data,
+               std::vector<span_t>& chunks) {
+    uint64_t offset = 0;
+    global_data = read_span_(bytes, offset);
+
+    uint64_t count = read_length_(bytes, offset);
+    // every chunk takes at least its length prefix
+    if (count > (bytes.size - offset) / sizeof(uint64_t)) {
+        throw std::runtime_error("Invalid chunk count in archive \"" +
+                                 bytes.name + "\"");
+    }
+    chunks.resize(count);
+    for (auto& span : chunks) {
+        span = read_span_(bytes, offset);
+    }
+    if (offset != bytes.size) {
+        throw std::runtime_error("Trailing data in archive \"" + bytes.name +
+                                 "\"");
+    }
+}
+
+static void
+copy_span_(const uint8_t* data, const span_t& span, chunk_t& chunk) {
+    chunk.assign(data + span.first, data + span.first + span.second);
+}
+
+pcl_compress::compressed_cloud_t
+read_archive(const uint8_t* data, uint64_t size, const std::string& name) {
+    span_t global_data;
+    std::vector<span_t> chunks;
+    index_archive_(bytes_t{data, size, name}, global_data, chunks);
+
+    pcl_compress::compressed_cloud_t cc;
+    copy_span_(data, global_data, cc.global_data);
+    cc.patch_image_data.resize(chunks.size());
+    for (uint64_t i = 0; i < chunks.size(); ++i) {
+        copy_span_(data, chunks[i], cc.patch_image_data[i]);
+    }
+    return cc;
+}
+
+pcl_compress::compressed_cloud_t
+read_archive(const mapped_file& file) {
+    return read_archive(file.data(), file.size(), file.path());
+}
+
+pcl_compress::compressed_cloud_t
+read_archive(const std::string& path) {
+    mapped_file file(path);
+    return read_archive(file);
+}
+
+archive_view::archive_view(const std::string& path) : file_(path) {
+    index_archive_(bytes_t{file_.data(), file_.size(), file_.path()},
+                   global_data_, chunks_);
+    data_chunk_count_ = chunks_.size();
+    if (!chunks_.empty()) {
+        chunk_t last;
+        copy_span_(file_.data(), chunks_.back(), last);
+        if (is_checksum_chunk(last, chunks_.size())) --data_chunk_count_;
+    }
+}
+
+archive_view::~archive_view() {}
+
+const mapped_file&
+archive_view::file() const {
+    return file_;
+}
+
+uint64_t
+archive_view::chunk_count() const {
+    return chunks_.size();
+}
+
+uint64_t
+archive_view::data_chunk_count() const {
+    return data_chunk_count_;
+}
+
+void
+archive_view::global_data(chunk_t& chunk) const {
+    copy_span_(file_.data(), global_data_, chunk);
+}
+
+void
+archive_view::chunk(uint64_t idx, chunk_t& chunk) const {
+    if (idx >= chunks_.size()) {
+        throw std::runtime_error("Chunk index out of range in archive \"" +
+                                 file_.path() + "\"");
+    }
+    copy_span_(file_.data(), chunks_[idx], chunk);
+}
+
+chunk_source_t
+archive_view::source() const {
+    chunk_source_t source;
+    source.key = this;
+    source.count = data_chunk_count_;
+    source.fetch = [this] (uint64_t idx, chunk_t& chunk) {
+        this->chunk(idx, chunk);
+    };
+    return source;
+}
+
+}  // duraark_compress
@@ -0,0 +1,59 @@
+#include <atomic_file.hpp>
+
+#include <fstream>
+#include <stdexcept>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+namespace fs = boost::filesystem;
+
+namespace duraark_compress {
+
+std::string
+temporary_path(const std::string& path) {
+    fs::path p(path);
+    std::string name = p.stem().string() + ".tmp-" +
+                       std::to_string(getpid()) + p.extension().string();
+    return (p.parent_path() / name).string();
+}
+
+void
+commit_file(const std::string& tmp, const std::string& path) {
+    boost::system::error_code error;
+    fs::rename(tmp, path, error);
+    if (error) {
+        discard_file(tmp);
+        throw std::runtime_error("Unable to move \"" + tmp + "\" to \"" +
+                                 path + "\": " + error.message());
+    }
+}
+
+void
+discard_file(const std::string& tmp) {
+    boost::system::error_code error;
+    fs::remove(tmp, error);
+}
+
+void
+write_file_atomic(const std::string& path,
+                  const std::function<void(std::ostream&)>& write) {
+    std::string tmp = temporary_path(path);
+    try {
+        std::ofstream out(tmp.c_str(), std::ios::out | std::ios::binary);
+        if (!out.good()) {
+            throw std::runtime_error("Unable to open file \"" + tmp +
+                                     "\" for writing.");
+        }
+        write(out);
+        out.close();
+        if (out.fail()) {
+            throw std::runtime_error("Unable to write file \"" + tmp + "\".");
+        }
+    } catch (...) {
+        discard_file(tmp);
+        throw;
+    }
+    commit_file(tmp, path);
+}
+
+}  // duraark_compress
@@ -0,0 +1,60 @@
+#include <cancellation.hpp>
+
+#include <atomic>
+#include <csignal>
+
+namespace duraark_compress {
+
+static std::atomic<bool> cancelled_(false);
+
+static void
+signal_handler_(int signal) {
+    cancelled_.store(true);
+    std::signal(signal, SIG_DFL);
+}
+
+cancelled_error::cancelled_error() : std::runtime_error("Cancelled") {}
+
+void
+request_cancel() {
+    cancelled_.store(true);
+}
+
+bool
+cancel_requested() {
+    return cancelled_.load(std::memory_order_relaxed);
+}
+
+void
+checkpoint() {
+    if (cancel_requested()) {
+        throw cancelled_error();
+    }
+}
+
+parallel_error::parallel_error() : failed_(false) {}
+
+bool
+parallel_error::failed() const {
+    return failed_.load(std::memory_order_relaxed);
+}
+
+void
+parallel_error::capture() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!error_) error_ = std::current_exception();
+    failed_.store(true);
+}
+
+void
+parallel_error::rethrow() const {
+    if (error_) std::rethrow_exception(error_);
+}
+
+void
+install_cancel_handlers() {
+    std::signal(SIGINT, signal_handler_);
+    std::signal(SIGTERM, signal_handler_);
+}
+
+}  // duraark_compress
@@ -0,0 +1,71 @@
+#include <checkpoint.hpp>
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+#include <boost/filesystem.hpp>
+
+#include <atomic_file.hpp>
+#include <checksum.hpp>
+
+namespace duraark_compress {
+
+static const char checkpoint_tag_[4] = {'D', 'C', 'K', 'P'};
+
+std::string
+checkpoint_path(const std::string& dir, uint32_t scan_index) {
+    return (boost::filesystem::path(dir) /
+            ("scan_" + std::to_string(scan_index) + ".ckpt")).string();
+}
+
+void
+save_checkpoint(const std::string& path, const scan_checkpoint_t& checkpoint) {
+    std::ostringstream payload;
+    {
+        cereal::BinaryOutputArchive ar(payload);
+        ar(checkpoint);
+    }
+    std::string data = payload.str();
+    uint32_t crc = crc32c(data.data(), data.size());
+
+    write_file_atomic(path, [&] (std::ostream& out) {
+        out.write(checkpoint_tag_, sizeof(checkpoint_tag_));
+        out.write(reinterpret_cast<const char*>(&crc), sizeof(uint32_t));
+        out.write(data.data(), data.size());
+    });
+}
+
+bool
+load_checkpoint(const std::string& path, uint32_t scan_index,
+                uint32_t fingerprint, scan_checkpoint_t& checkpoint) {
+    std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+    if (!in.good()) return false;
+    std::string data((std::istreambuf_iterator<char>(in)),
+                     std::istreambuf_iterator<char>());
+
+    std::size_t header = sizeof(checkpoint_tag_) + sizeof(uint32_t);
+    if (data.size() < header ||
+        std::memcmp(data.data(), checkpoint_tag_, sizeof(checkpoint_tag_))) {
+        return false;
+    }
+    uint32_t crc;
+    std::memcpy(&crc, data.data() + sizeof(checkpoint_tag_), sizeof(uint32_t));
+    if (crc32c(data.data() + header, data.size() - header) != crc) {
+        return false;
+    }
+
+    try {
+        std::istringstream payload(data.substr(header));
+        cereal::BinaryInputArchive ar(payload);
+        ar(checkpoint);
+    } catch (std::exception&) {
+        return false;
+    }
+    return checkpoint.scan_index == scan_index &&
+           checkpoint.fingerprint == fingerprint &&
+           checkpoint.chunks.size() == 2 * checkpoint.gdata.origins.size();
+}
+
+}  // duraark_compress
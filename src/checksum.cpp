@@ -0,0 +1,152 @@
+#include <checksum.hpp>
+
+#include <cstring>
+
+namespace duraark_compress {
+
+using pcl_compress::chunk_t;
+using pcl_compress::compressed_cloud_t;
+
+static const char checksum_tag_[4] = {'D', 'C', 'R', 'C'};
+// tag, chunk count, global data crc, archive crc
+static const std::size_t checksum_header_size_ =
+    sizeof(checksum_tag_) + 3 * sizeof(uint32_t);
+
+// slicing-by-8 tables for the reflected polynomial 0x82f63b78
+typedef struct crc_tables_ {
+    uint32_t table[8][256];
+
+    crc_tables_() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int k = 0; k < 8; ++k) {
+                crc = (crc >> 1) ^ (0x82f63b78 & (0u - (crc & 1)));
+            }
+            table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int t = 1; t < 8; ++t) {
+                table[t][i] = (table[t - 1][i] >> 8) ^
+                              table[0][table[t - 1][i] & 0xff];
+            }
+        }
+    }
+} crc_tables_t;
+
+uint32_t
+crc32c(const void* data, std::size_t size, uint32_t crc) {
+    static const crc_tables_t tables;
+    const uint32_t (&t)[8][256] = tables.table;
+    const uint8_t* in = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+    for (; size >= 8; size -= 8, in += 8) {
+        uint32_t lo, hi;
+        std::memcpy(&lo, in, 4);
+        std::memcpy(&hi, in + 4, 4);
+        lo ^= crc;
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+              t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+              t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    }
+    for (; size; --size, ++in) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *in) & 0xff];
+    }
+    return ~crc;
+}
+
+static std::vector<uint32_t>
+chunk_checksums_(const compressed_cloud_t& cc, uint32_t count) {
+    std::vector<uint32_t> crcs(count);
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (uint32_t i = 0; i < count; ++i) {
+        crcs[i] = crc32c(cc.patch_image_data[i].data(),
+                         cc.patch_image_data[i].size());
+    }
+    return crcs;
+}
+
+static uint32_t
+archive_crc_(uint32_t global_crc, const std::vector<uint32_t>& crcs) {
+    uint32_t crc = crc32c(&global_crc, sizeof(uint32_t));
+    return crc32c(crcs.data(), crcs.size() * sizeof(uint32_t), crc);
+}
+
+bool
+is_checksum_chunk(const chunk_t& chunk, uint64_t chunk_count) {
+    if (chunk.size() < checksum_header_size_ ||
+        std::memcmp(chunk.data(), checksum_tag_, sizeof(checksum_tag_))) {
+        return false;
+    }
+    uint32_t count;
+    std::memcpy(&count, chunk.data() + sizeof(checksum_tag_), sizeof(uint32_t));
+    return count == chunk_count - 1 &&
+           chunk.size() == checksum_header_size_ + count * sizeof(uint32_t);
+}
+
+bool
+has_checksums(const compressed_cloud_t& cc) {
+    if (cc.patch_image_data.empty()) return false;
+    return is_checksum_chunk(cc.patch_image_data.back(),
+                             cc.patch_image_data.size());
+}
+
+uint32_t
+data_chunk_count(const compressed_cloud_t& cc) {
+    return cc.patch_image_data.size() - (has_checksums(cc) ? 1 : 0);
+}
+
+void
+append_checksums(compressed_cloud_t& cc) {
+    uint32_t count = cc.patch_image_data.size();
+    std::vector<uint32_t> crcs = chunk_checksums_(cc, count);
+    uint32_t header[3] = {
+        count, crc32c(cc.global_data.data(), cc.global_data.size()), 0};
+    header[2] = archive_crc_(header[1], crcs);
+
+    chunk_t chunk(checksum_header_size_ + count * sizeof(uint32_t));
+    uint8_t* out = chunk.data();
+    std::memcpy(out, checksum_tag_, sizeof(checksum_tag_));
+    std::memcpy(out + sizeof(checksum_tag_), header, sizeof(header));
+    std::memcpy(out + checksum_header_size_, crcs.data(),
+                count * sizeof(uint32_t));
+    cc.patch_image_data.push_back(std::move(chunk));
+}
+
+uint32_t
+archive_checksum(const compressed_cloud_t& cc) {
+    if (!has_checksums(cc)) {
+        throw std::runtime_error("Archive contains no checksums");
+    }
+    uint32_t crc;
+    std::memcpy(&crc,
+                cc.patch_image_data.back().data() + sizeof(checksum_tag_) +
+                    2 * sizeof(uint32_t),
+                sizeof(uint32_t));
+    return crc;
+}
+
+verify_result_t
+verify_checksums(const compressed_cloud_t& cc) {
+    if (!has_checksums(cc)) {
+        throw std::runtime_error("Archive contains no checksums");
+    }
+    const uint8_t* in = cc.patch_image_data.back().data();
+    uint32_t header[3];
+    std::memcpy(header, in + sizeof(checksum_tag_), sizeof(header));
+    std::vector<uint32_t> stored(header[0]);
+    std::memcpy(stored.data(), in + checksum_header_size_,
+                stored.size() * sizeof(uint32_t));
+
+    std::vector<uint32_t> crcs = chunk_checksums_(cc, header[0]);
+    verify_result_t result;
+    result.global_data_ok =
+        crc32c(cc.global_data.data(), cc.global_data.size()) == header[1];
+    result.archive_ok = archive_crc_(header[1], stored) == header[2];
+    for (uint32_t i = 0; i < crcs.size(); ++i) {
+        if (crcs[i] != stored[i]) result.corrupt_chunks.push_back(i);
+    }
+    return result;
+}
+
+}  // duraark_compress
@@ -0,0 +1,173 @@
+#include <compact_cloud.hpp>
+
+#include <octahedral.hpp>
+
+namespace duraark_compress {
+
+template <typename PointT>
+static void
+set_normal_(PointT& p, const vec3f_t& n) {
+    p.normal_x = n[0];
+    p.normal_y = n[1];
+    p.normal_z = n[2];
+}
+
+static void
+set_normal_(point_xyz_t&, const vec3f_t&) {}
+
+compact_cloud::compact_cloud() : sensor_origin_(vec3f_t::Zero()) {}
+
+compact_cloud::compact_cloud(const cloud_normal_t& cloud)
+    : x_(cloud.size()),
+      y_(cloud.size()),
+      z_(cloud.size()),
+      normals_(cloud.size()),
+      sensor_origin_(cloud.sensor_origin_.head(3)) {
+    for (uint32_t i = 0; i < cloud.size(); ++i) {
+        const point_normal_t& p = cloud.points[i];
+        x_[i] = p.x;
+        y_[i] = p.y;
+        z_[i] = p.z;
+        normals_[i] = oct_encode(p.getNormalVector3fMap());
+    }
+}
+
+compact_cloud::compact_cloud(const compact_cloud& cloud,
+                             const std::vector<int>& subset)
+    : x_(subset.size()),
+      y_(subset.size()),
+      z_(subset.size()),
+      normals_(subset.size()),
+      sensor_origin_(cloud.sensor_origin_) {
+    for (uint32_t i = 0; i < subset.size(); ++i) {
+        x_[i] = cloud.x_[subset[i]];
+        y_[i] = cloud.y_[subset[i]];
+        z_[i] = cloud.z_[subset[i]];
+        normals_[i] = cloud.normals_[subset[i]];
+    }
+}
+
+compact_cloud::~compact_cloud() {}
+
+uint32_t
+compact_cloud::size() const {
+    return x_.size();
+}
+
+bool
+compact_cloud::empty() const {
+    return x_.empty();
+}
+
+void
+compact_cloud::reserve(uint32_t count) {
+    x_.reserve(count);
+    y_.reserve(count);
+    z_.reserve(count);
+    normals_.reserve(count);
+}
+
+void
+compact_cloud::push_back(const vec3f_t& point, const vec3f_t& normal) {
+    x_.push_back(point[0]);
+    y_.push_back(point[1]);
+    z_.push_back(point[2]);
+    normals_.push_back(oct_encode(normal));
+}
+
+template <typename T>
+static void
+permute_(std::vector<T>& values, const std::vector<uint32_t>& order) {
+    std::vector<T> permuted(order.size());
+    #pragma omp parallel for schedule(static)
+    for (uint32_t i = 0; i < order.size(); ++i) {
+        permuted[i] = values[order[i]];
+    }
+    values.swap(permuted);
+}
+
+void
+compact_cloud::permute(const std::vector<uint32_t>& order) {
+    // one array at a time, so only a single temporary copy is alive
+    permute_(x_, order);
+    permute_(y_, order);
+    permute_(z_, order);
+    permute_(normals_, order);
+}
+
+vec3f_t
+compact_cloud::point(uint32_t idx) const {
+    return vec3f_t(x_[idx], y_[idx], z_[idx]);
+}
+
+vec3f_t
+compact_cloud::normal(uint32_t idx) const {
+    return oct_decode(normals_[idx]);
+}
+
+const vec3f_t&
+compact_cloud::sensor_origin() const {
+    return sensor_origin_;
+}
+
+void
+compact_cloud::set_sensor_origin(const vec3f_t& origin) {
+    sensor_origin_ = origin;
+}
+
+bbox3f_t
+compact_cloud::bounding_box() const {
+    bbox3f_t bbox;
+    for (uint32_t i = 0; i < size(); ++i) {
+        bbox.extend(point(i));
+    }
+    return bbox;
+}
+
+cloud_normal_t::Ptr
+compact_cloud::extract(const std::vector<int>& subset) const {
+    cloud_normal_t::Ptr cloud = to_cloud<point_normal_t>(subset);
+    cloud->sensor_origin_.head(3) = sensor_origin_;
+    return cloud;
+}
+
+void
+compact_cloud::extract(const std::vector<int>& subset,
+                       cloud_normal_t& cloud) const {
+    cloud.resize(subset.size());
+    for (uint32_t i = 0; i < subset.size(); ++i) {
+        point_normal_t& p = cloud.points[i];
+        p.getVector3fMap() = point(subset[i]);
+        set_normal_(p, normal(subset[i]));
+    }
+    cloud.width = subset.size();
+    cloud.height = 1;
+    cloud.sensor_origin_.head(3) = sensor_origin_;
+}
+
+template <typename PointT>
+typename pcl::PointCloud<PointT>::Ptr
+compact_cloud::to_cloud(const std::vector<int>& subset) const {
+    typename pcl::PointCloud<PointT>::Ptr cloud(new pcl::PointCloud<PointT>());
+    uint32_t count = subset.empty() ? size() : subset.size();
+    cloud->resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t idx = subset.empty() ? i : subset[i];
+        PointT& p = cloud->points[i];
+        p.getVector3fMap() = point(idx);
+        set_normal_(p, normal(idx));
+    }
+    cloud->width = count;
+    cloud->height = 1;
+    return cloud;
+}
+
+// explicit instantiations
+template pcl::PointCloud<point_xyz_t>::Ptr
+compact_cloud::to_cloud<point_xyz_t>(const std::vector<int>&) const;
+template pcl::PointCloud<point_normal_t>::Ptr
+compact_cloud::to_cloud<point_normal_t>(const std::vector<int>&) const;
+template pcl::PointCloud<point_detect_t>::Ptr
+compact_cloud::to_cloud<point_detect_t>(const std::vector<int>&) const;
+
+}  // duraark_compress
@@ -1,13 +1,29 @@
 #include <decomposition.hpp>
 
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <set>
+
+#include <pcl/common/io.h>
 #include <pcl/octree/octree.h>
 #include <pcl/octree/octree_impl.h>
 #include <primitive_detection/PrimitiveDetector.h>
 
 #include <quadtree.hpp>
+#include <compact_cloud.hpp>
+#include <cancellation.hpp>
 
 namespace duraark_compress {
 
+// target point count of the detector input tiles of compact clouds
+static const uint32_t max_detect_points_ = 1 << 21;
+// per-tile minimum support is min_points divided by this: a plane no larger
+// than a tile is split over at most four tiles, one of which holds at least
+// a quarter of its points
+static const uint32_t tile_support_divisor_ = 4;
+static const uint32_t min_tile_support_ = 3;
+
 template <typename PointT>
 decomposition_t
 octree_decomposition(typename pcl::PointCloud<PointT>::ConstPtr cloud,
@@ -34,15 +50,16 @@ octree_decomposition(typename pcl::PointCloud<PointT>::ConstPtr cloud,
     return decomp;
 }
 
+typedef struct plane_ {
+    vec3f_t normal;
+    subset_t indices;
+    float area;
+} plane_t;
+
 template <typename PointT>
-decomposition_t
-primitive_decomposition(typename pcl::PointCloud<PointT>::ConstPtr cloud,
-                        const prim_detect_params_t& prim_params,
-                        uint32_t max_points_per_cell,
-                        uint32_t max_depth,
-                        float residual_leaf_size,
-                        decomposition_t* primitive_sets,
-                        uint32_t* primitive_patches) {
+static std::vector<plane_t>
+detect_planes_(typename pcl::PointCloud<PointT>::ConstPtr cloud,
+               const prim_detect_params_t& prim_params) {
     pcshapes::PrimitiveDetector detector;
     detector.setEpsilon(prim_params.epsilon);
     detector.setBitmapEpsilon(prim_params.bitmap_epsilon);
@@ -53,23 +70,285 @@ primitive_decomposition(typename pcl::PointCloud<PointT>::ConstPtr cloud,
     types.set(pcshapes::PLANE);
     auto primitives = detector.detectPrimitives<PointT>(cloud, types);
 
-    std::set<uint32_t> residual_set, included_set;
-    for (uint32_t i = 0; i < cloud->size(); ++i) {
-        residual_set.insert(i);
+    std::vector<plane_t> planes;
+    for (auto prim : primitives) {
+        auto primPlane =
+            std::dynamic_pointer_cast<pcshapes::PrimitivePlane>(prim);
+        planes.push_back({primPlane->normal().normalized(),
+                          primPlane->indices(), primPlane->area()});
+    }
+    return planes;
+}
+
+// least squares plane fit, accumulated over points
+typedef struct plane_fit_ {
+    Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+    Eigen::Matrix3d outer = Eigen::Matrix3d::Zero();
+    uint64_t count = 0;
+} plane_fit_t;
+
+static void
+fit_add_(plane_fit_t& fit, const vec3f_t& point) {
+    Eigen::Vector3d p = point.cast<double>();
+    fit.sum += p;
+    fit.outer += p * p.transpose();
+    ++fit.count;
+}
+
+static plane_fit_t
+fit_merge_(const plane_fit_t& a, const plane_fit_t& b) {
+    plane_fit_t fit;
+    fit.sum = a.sum + b.sum;
+    fit.outer = a.outer + b.outer;
+    fit.count = a.count + b.count;
+    return fit;
+}
+
+// sets the normal of the fitted plane and returns the rms distance of the
+// points to it
+static float
+fit_plane_(const plane_fit_t& fit, vec3f_t& normal) {
+    if (!fit.count) {
+        normal = vec3f_t::UnitZ();
+        return 0.f;
+    }
+    Eigen::Vector3d centroid = fit.sum / fit.count;
+    Eigen::Matrix3d cov =
+        fit.outer / fit.count - centroid * centroid.transpose();
+    // eigenvalues are sorted in increasing order
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(cov);
+    normal = solver.eigenvectors().col(0).cast<float>();
+    return static_cast<float>(std::sqrt(std::max(0.0, solver.eigenvalues()[0])));
+}
+
+// Detects planes in overlapping xy tiles in parallel and merges coplanar
+// planes sharing points in the overlap regions. Points claimed by several
+// non-coplanar planes stay with the first one (in tile order). Tiles use a
+// reduced minimum support, min_points is left to filter_planes_ after the
+// merge. Every piece contributes its area in proportion to the points it
+// owns, so overlap regions are not counted repeatedly. Only the points of
+// the tiles currently being processed are materialized by extract.
+template <typename PointT, typename PositionFunc, typename ExtractFunc>
+static std::vector<plane_t>
+detect_planes_tiled_(uint32_t num_points,
+                     PositionFunc&& position,
+                     ExtractFunc&& extract,
+                     float tile_size,
+                     const prim_detect_params_t& prim_params) {
+    const float overlap = prim_params.tile_overlap;
+    prim_detect_params_t tile_params = prim_params;
+    tile_params.min_points = std::max(
+        prim_params.min_points / tile_support_divisor_, min_tile_support_);
+
+    bbox3f_t bbox;
+    for (uint32_t i = 0; i < num_points; ++i) {
+        bbox.extend(position(i));
+    }
+    vec3f_t extent = bbox.sizes();
+    int tiles_x = std::max(1, static_cast<int>(std::ceil(extent[0] / tile_size)));
+    int tiles_y = std::max(1, static_cast<int>(std::ceil(extent[1] / tile_size)));
+    auto tile_coord = [&] (float v, float min, int tiles) {
+        return std::min(tiles - 1, std::max(0, static_cast<int>(std::floor((v - min) / tile_size))));
+    };
+
+    std::vector<subset_t> tiles(tiles_x * tiles_y);
+    for (uint32_t i = 0; i < num_points; ++i) {
+        vec3f_t p = position(i);
+        int x0 = tile_coord(p[0] - overlap, bbox.min()[0], tiles_x);
+        int x1 = tile_coord(p[0] + overlap, bbox.min()[0], tiles_x);
+        int y0 = tile_coord(p[1] - overlap, bbox.min()[1], tiles_y);
+        int y1 = tile_coord(p[1] + overlap, bbox.min()[1], tiles_y);
+        for (int y = y0; y <= y1; ++y) {
+            for (int x = x0; x <= x1; ++x) {
+                tiles[y * tiles_x + x].push_back(i);
+            }
+        }
+    }
+
+    std::vector<std::vector<plane_t>> tile_planes(tiles.size());
+    parallel_error error;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (uint32_t t = 0; t < tiles.size(); ++t) {
+        if (tiles[t].size() < tile_params.min_points || cancel_requested() || error.failed()) continue;
+        try {
+            typename pcl::PointCloud<PointT>::ConstPtr tile_cloud = extract(tiles[t]);
+            tile_planes[t] = detect_planes_<PointT>(tile_cloud, tile_params);
+            for (auto& plane : tile_planes[t]) {
+                for (auto& idx : plane.indices) {
+                    idx = tiles[t][idx];
+                }
+            }
+            subset_t().swap(tiles[t]);
+        } catch (...) {
+            error.capture();
+        }
+    }
+    error.rethrow();
+    checkpoint();
+
+    std::vector<plane_t> pieces;
+    for (auto& planes : tile_planes) {
+        pieces.insert(pieces.end(), planes.begin(), planes.end());
+    }
+    std::vector<plane_fit_t> fits(pieces.size());
+    for (uint32_t i = 0; i < pieces.size(); ++i) {
+        for (const auto& idx : pieces[i].indices) {
+            fit_add_(fits[i], position(idx));
+        }
+    }
+
+    // Unions coplanar pieces that claim the same points. Fits are kept per
+    // union (at its root) and every candidate union is tested against the
+    // plane refitted to all of its points, so chains of pairwise coplanar
+    // pieces can not drift away from a common plane.
+    std::vector<uint32_t> parent(pieces.size());
+    std::iota(parent.begin(), parent.end(), 0);
+    std::function<uint32_t(uint32_t)> find = [&] (uint32_t i) {
+        return parent[i] == i ? i : (parent[i] = find(parent[i]));
+    };
+    auto coplanar = [&] (const plane_fit_t& merged, uint32_t a, uint32_t b) {
+        vec3f_t normal, normal_a, normal_b;
+        if (fit_plane_(merged, normal) >= prim_params.epsilon) return false;
+        fit_plane_(fits[a], normal_a);
+        fit_plane_(fits[b], normal_b);
+        float min_cos = 1.f - prim_params.angle_threshold;
+        return std::fabs(normal.dot(normal_a)) > min_cos &&
+               std::fabs(normal.dot(normal_b)) > min_cos;
+    };
+    std::vector<int> owner(num_points, -1);
+    for (uint32_t i = 0; i < pieces.size(); ++i) {
+        std::set<uint32_t> claimed;
+        for (const auto& idx : pieces[i].indices) {
+            if (owner[idx] < 0) {
+                owner[idx] = i;
+            } else {
+                claimed.insert(owner[idx]);
+            }
+        }
+        for (const auto& j : claimed) {
+            uint32_t a = find(j), b = find(i);
+            if (a == b) continue;
+            plane_fit_t merged = fit_merge_(fits[a], fits[b]);
+            if (coplanar(merged, a, b)) {
+                parent[b] = a;
+                fits[a] = merged;
+            }
+        }
+    }
+
+    std::vector<uint32_t> owned(pieces.size(), 0);
+    for (const auto& i : owner) {
+        if (i >= 0) ++owned[i];
+    }
+
+    std::map<uint32_t, uint32_t> merged_index;
+    std::vector<plane_t> planes;
+    for (uint32_t i = 0; i < pieces.size(); ++i) {
+        uint32_t root = find(i);
+        auto found = merged_index.find(root);
+        if (found == merged_index.end()) {
+            found = merged_index.insert({root, planes.size()}).first;
+            planes.push_back({vec3f_t::Zero(), subset_t(), 0.f});
+        }
+        plane_t& plane = planes[found->second];
+        float sign = plane.normal.dot(pieces[i].normal) < 0.f ? -1.f : 1.f;
+        plane.normal += sign * pieces[i].normal * pieces[i].indices.size();
+        if (!pieces[i].indices.empty()) {
+            plane.area += pieces[i].area * owned[i] / pieces[i].indices.size();
+        }
+    }
+    for (uint32_t idx = 0; idx < owner.size(); ++idx) {
+        if (owner[idx] < 0) continue;
+        planes[merged_index[find(owner[idx])]].indices.push_back(idx);
+    }
+    for (const auto& entry : merged_index) {
+        plane_t& plane = planes[entry.second];
+        vec3f_t normal;
+        fit_plane_(fits[entry.first], normal);
+        plane.normal = normal.dot(plane.normal) < 0.f ? -normal : normal;
+    }
+
+    return planes;
+}
+
+// removes planes below the minimum support or area, including merged planes
+// that lost all their points to other planes
+static std::vector<plane_t>
+filter_planes_(std::vector<plane_t> planes,
+               const prim_detect_params_t& prim_params) {
+    planes.erase(std::remove_if(planes.begin(), planes.end(), [&] (const plane_t& plane) {
+        return plane.indices.empty() ||
+               plane.indices.size() < prim_params.min_points ||
+               plane.area < prim_params.min_area;
+    }), planes.end());
+    return planes;
+}
+
+template <typename PointT>
+static std::vector<plane_t>
+find_planes_(typename pcl::PointCloud<PointT>::ConstPtr cloud,
+             const prim_detect_params_t& prim_params) {
+    if (prim_params.tile_size <= 0.f) {
+        return filter_planes_(detect_planes_<PointT>(cloud, prim_params), prim_params);
     }
+    return filter_planes_(detect_planes_tiled_<PointT>(
+        cloud->size(),
+        [&] (uint32_t idx) -> vec3f_t { return cloud->points[idx].getVector3fMap(); },
+        [&] (const subset_t& subset) {
+            typename pcl::PointCloud<PointT>::Ptr tile_cloud(new pcl::PointCloud<PointT>());
+            pcl::copyPointCloud(*cloud, subset, *tile_cloud);
+            return tile_cloud;
+        },
+        prim_params.tile_size, prim_params), prim_params);
+}
 
+// Compact clouds are never handed to the detector as a whole. Without an
+// explicit tile size the tiles are sized to hold about max_detect_points_
+// points each (given a uniform xy distribution), so at most one detector
+// cloud of that size exists per thread.
+static std::vector<plane_t>
+find_planes_(const compact_cloud& cloud,
+             const prim_detect_params_t& prim_params) {
+    float tile_size = prim_params.tile_size;
+    if (tile_size <= 0.f) {
+        vec3f_t extent = cloud.bounding_box().sizes();
+        float area = std::max(extent[0] * extent[1], 1e-6f);
+        tile_size = std::max(extent[0], extent[1]);
+        if (cloud.size() > max_detect_points_) {
+            float tile_area = area * max_detect_points_ / cloud.size();
+            tile_size = std::min(tile_size, std::sqrt(tile_area));
+        }
+        tile_size = std::max({tile_size, 4.f * prim_params.tile_overlap, 1e-3f});
+    }
+    return filter_planes_(detect_planes_tiled_<point_detect_t>(
+        cloud.size(),
+        [&] (uint32_t idx) { return cloud.point(idx); },
+        [&] (const subset_t& subset) {
+            return cloud.to_cloud<point_detect_t>(subset);
+        },
+        tile_size, prim_params), prim_params);
+}
+
+template <typename PositionFunc>
+static decomposition_t
+plane_decomposition_(const std::vector<plane_t>& planes,
+                     PositionFunc&& position,
+                     const prim_detect_params_t& prim_params,
+                     uint32_t max_points_per_cell,
+                     uint32_t max_depth,
+                     decomposition_t* primitive_sets) {
     decomposition_t decomp;
     quadtree::params_t quadtree_params = {
         max_depth,
-        max_points_per_cell
+        max_points_per_cell,
+        prim_params.max_height_deviation,
+        std::max(1.f, prim_params.flat_cell_factor),
+        prim_params.merge_flat_cells
     };
-    //uint32_t prim_idx = 0;
-    for (auto prim : primitives) {
-        auto primPlane =
-            std::dynamic_pointer_cast<pcshapes::PrimitivePlane>(prim);
-        if (primPlane->area() < prim_params.min_area) continue;
-        subset_t indices = primPlane->indices();
-        vec3f_t normal = primPlane->normal().normalized();
+    for (const auto& plane : planes) {
+        checkpoint();
+        const subset_t& indices = plane.indices;
+        const vec3f_t& normal = plane.normal;
         vec3f_t bitangent =
             (1.f - fabs(normal[2])) < Eigen::NumTraits<float>::dummy_precision()
                 ? vec3f_t::UnitX()
@@ -80,46 +359,110 @@ primitive_decomposition(typename pcl::PointCloud<PointT>::ConstPtr cloud,
         local << tangent, bitangent, normal;
         local.transposeInPlace();
         std::vector<vec2f_t> uv(indices.size());
+        std::vector<float> heights(indices.size());
         for (uint32_t i = 0; i < indices.size(); ++i) {
-            uv[i] = (local * cloud->points[indices[i]].getVector3fMap()).head(2);
+            vec3f_t p = local * position(indices[i]);
+            uv[i] = p.head(2);
+            heights[i] = p[2];
         }
 
         if (primitive_sets) {
             primitive_sets->push_back(indices);
         }
 
-        quadtree::ptr_t qt(new quadtree(uv, quadtree_params));
+        quadtree::ptr_t qt(new quadtree(uv, quadtree_params, &heights));
         for (const auto& leaf : qt->leaves()) {
             const auto& leaf_indices = leaf.indices();
             if (leaf_indices.size() < 5) continue;
             subset_t global_indices(leaf_indices.size());
             std::transform(leaf_indices.begin(), leaf_indices.end(), global_indices.begin(), [&] (int idx) { return indices[idx]; });
             decomp.push_back(global_indices);
-            included_set.insert(global_indices.begin(), global_indices.end());
         }
     }
+    return decomp;
+}
 
-    if (primitive_patches) *primitive_patches = decomp.size();
+// all indices in [0, num_points) not included in any subset of decomp
+static subset_t
+residual_indices_(uint32_t num_points, const decomposition_t& decomp) {
+    std::vector<bool> included(num_points, false);
+    for (const auto& subset : decomp) {
+        for (const auto& idx : subset) {
+            included[idx] = true;
+        }
+    }
+    subset_t residual;
+    for (uint32_t i = 0; i < num_points; ++i) {
+        if (!included[i]) residual.push_back(i);
+    }
+    return residual;
+}
 
+template <typename PointT>
+decomposition_t
+primitive_decomposition(typename pcl::PointCloud<PointT>::ConstPtr cloud,
+                        const prim_detect_params_t& prim_params,
+                        uint32_t max_points_per_cell,
+                        uint32_t max_depth,
+                        float residual_leaf_size,
+                        decomposition_t* primitive_sets,
+                        uint32_t* primitive_patches) {
+    checkpoint();
+    std::vector<plane_t> planes = find_planes_<PointT>(cloud, prim_params);
+    checkpoint();
+    decomposition_t decomp = plane_decomposition_(
+        planes,
+        [&](int idx) -> vec3f_t { return cloud->points[idx].getVector3fMap(); },
+        prim_params, max_points_per_cell, max_depth, primitive_sets);
 
-    // copy residual set while removing all indices included in primitives
-    subset_t residual(residual_set.size());
-    auto new_end = std::set_difference(residual_set.begin(), residual_set.end(),
-                                       included_set.begin(), included_set.end(),
-                                       residual.begin());
-    residual.resize(std::distance(residual.begin(), new_end));
+    if (primitive_patches) *primitive_patches = decomp.size();
 
     // use octree decomposition for all remaining points
+    checkpoint();
+    subset_t residual = residual_indices_(cloud->size(), decomp);
     if (residual.size() > 5) {
-        //decomp.push_back(residual);
         decomposition_t res_decomp =
             octree_decomposition<PointT>(cloud, residual_leaf_size, residual);
         for (const auto& subset : res_decomp) {
             if (subset.size() > 5) decomp.push_back(subset);
         }
-        //decomp.insert(decomp.end(), res_decomp.begin(), res_decomp.end());
-    } else {
-        std::cout << "no residual" << "\n";
+    }
+
+    return decomp;
+}
+
+decomposition_t
+primitive_decomposition(const compact_cloud& cloud,
+                        const prim_detect_params_t& prim_params,
+                        uint32_t max_points_per_cell,
+                        uint32_t max_depth,
+                        float residual_leaf_size,
+                        decomposition_t* primitive_sets,
+                        uint32_t* primitive_patches) {
+    checkpoint();
+    std::vector<plane_t> planes = find_planes_(cloud, prim_params);
+    checkpoint();
+    decomposition_t decomp = plane_decomposition_(
+        planes, [&](int idx) { return cloud.point(idx); },
+        prim_params, max_points_per_cell, max_depth, primitive_sets);
+
+    if (primitive_patches) *primitive_patches = decomp.size();
+
+    // use octree decomposition for all remaining points, only the residual
+    // points are materialized (without normals)
+    checkpoint();
+    subset_t residual = residual_indices_(cloud.size(), decomp);
+    if (residual.size() > 5) {
+        cloud_xyz_t::ConstPtr res_cloud = cloud.to_cloud<point_xyz_t>(residual);
+        decomposition_t res_decomp =
+            octree_decomposition<point_xyz_t>(res_cloud, residual_leaf_size);
+        for (auto& subset : res_decomp) {
+            if (subset.size() <= 5) continue;
+            for (auto& idx : subset) {
+                idx = residual[idx];
+            }
+            decomp.push_back(subset);
+        }
     }
 
     return decomp;
@@ -132,8 +475,14 @@ template decomposition_t octree_decomposition<pcl::PointNormal>(
 template decomposition_t octree_decomposition<pcl::PointXYZ>(
     typename pcl::PointCloud<pcl::PointXYZ>::ConstPtr, float,
     ex::optional<subset_t>);
+template decomposition_t octree_decomposition<point_detect_t>(
+    typename pcl::PointCloud<point_detect_t>::ConstPtr, float,
+    ex::optional<subset_t>);
 template decomposition_t primitive_decomposition<pcl::PointNormal>(
     typename pcl::PointCloud<pcl::PointNormal>::ConstPtr,
     const prim_detect_params_t&, uint32_t, uint32_t, float, decomposition_t*, uint32_t*);
+template decomposition_t primitive_decomposition<point_detect_t>(
+    typename pcl::PointCloud<point_detect_t>::ConstPtr,
+    const prim_detect_params_t&, uint32_t, uint32_t, float, decomposition_t*, uint32_t*);
 
 }  // duraark_compress
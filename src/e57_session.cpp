@@ -0,0 +1,230 @@
+#include <e57_session.hpp>
+
+#include <e57/E57Foundation.h>
+
+#include <compact_cloud.hpp>
+
+namespace duraark_compress {
+
+// records decoded per reader call
+static const uint32_t block_size_ = 1 << 16;
+
+static const char* coord_fields_[3] = {"cartesianX", "cartesianY",
+                                       "cartesianZ"};
+static const char* normal_fields_[3] = {"nor:normalX", "nor:normalY",
+                                        "nor:normalZ"};
+
+struct e57_session::e57_file_ {
+    e57_file_(const std::string& path) : imf(path, "r") {}
+    ~e57_file_() {
+        try {
+            imf.close();
+        } catch (...) {
+        }
+    }
+
+    e57::ImageFile imf;
+};
+
+static std::runtime_error
+error_(const std::string& path, const e57::E57Exception& e) {
+    return std::runtime_error("Unable to read E57 file \"" + path + "\": " +
+                              e.what());
+}
+
+static e57::StructureNode
+scan_node_(const e57::ImageFile& imf, uint32_t idx) {
+    e57::VectorNode data3d(imf.root().get("/data3D"));
+    return e57::StructureNode(data3d.get(idx));
+}
+
+static double
+float_value_(const e57::StructureNode& node, const std::string& path,
+             double fallback) {
+    return node.isDefined(path) ? e57::FloatNode(node.get(path)).value()
+                                : fallback;
+}
+
+e57_session::e57_session(const std::string& path) : path_(path) {
+    try {
+        file_.reset(new e57_file_(path));
+        e57::StructureNode root = file_->imf.root();
+        if (root.isDefined("guid")) {
+            guid_ = e57::StringNode(root.get("guid")).value();
+        }
+        if (!root.isDefined("/data3D")) return;
+        e57::VectorNode data3d(root.get("/data3D"));
+        for (int64_t i = 0; i < data3d.childCount(); ++i) {
+            e57::StructureNode scan(data3d.get(i));
+            e57::CompressedVectorNode points(scan.get("points"));
+            e57::StructureNode prototype(points.prototype());
+            scan_info_t info;
+            info.point_count = points.childCount();
+            info.has_normals = true;
+            for (const auto& field : coord_fields_) {
+                if (!prototype.isDefined(field)) {
+                    throw std::runtime_error(
+                        "Scan " + std::to_string(i) + " of \"" + path +
+                        "\" has no cartesian coordinates");
+                }
+            }
+            for (const auto& field : normal_fields_) {
+                info.has_normals = info.has_normals && prototype.isDefined(field);
+            }
+            scans_.push_back(info);
+        }
+    } catch (e57::E57Exception& e) {
+        throw error_(path, e);
+    }
+}
+
+e57_session::~e57_session() {}
+
+const std::string&
+e57_session::path() const {
+    return path_;
+}
+
+const std::string&
+e57_session::guid() const {
+    return guid_;
+}
+
+uint32_t
+e57_session::scan_count() const {
+    return scans_.size();
+}
+
+const e57_session::scan_info_t&
+e57_session::scan(uint32_t idx) const {
+    return scans_.at(idx);
+}
+
+std::vector<cloud_normal_t::Ptr>
+e57_session::load(const std::vector<uint32_t>& scans, std::string& guid) const {
+    std::vector<cloud_normal_t::Ptr> clouds;
+    for (const auto& idx : scans) {
+        if (idx >= scans_.size()) {
+            throw std::runtime_error("Scan index " + std::to_string(idx) +
+                                     " out of range");
+        }
+        if (!scans_[idx].has_normals) {
+            clouds.push_back(e57_pcl::load_e57_scans_with_normals(
+                path_, guid, true, nullptr, {idx})[0]);
+            continue;
+        }
+        cloud_normal_t::Ptr cloud(new cloud_normal_t());
+        cloud->reserve(scans_[idx].point_count);
+        vec3f_t origin = read(idx, [&] (const std::vector<vec3f_t>& points,
+                                        const std::vector<vec3f_t>& normals) {
+            for (uint32_t i = 0; i < points.size(); ++i) {
+                point_normal_t p;
+                p.getVector3fMap() = points[i];
+                p.getNormalVector3fMap() = normals[i];
+                p.curvature = 0.f;
+                cloud->push_back(p);
+            }
+        });
+        cloud->sensor_origin_.head(3) = origin;
+        clouds.push_back(cloud);
+    }
+    guid = guid_;
+    return clouds;
+}
+
+std::shared_ptr<compact_cloud>
+e57_session::load_compact(uint32_t idx) const {
+    if (idx >= scans_.size()) {
+        throw std::runtime_error("Scan index " + std::to_string(idx) +
+                                 " out of range");
+    }
+    if (!scans_[idx].has_normals) {
+        std::string guid;
+        return std::make_shared<compact_cloud>(*load({idx}, guid)[0]);
+    }
+    std::shared_ptr<compact_cloud> cloud = std::make_shared<compact_cloud>();
+    cloud->reserve(scans_[idx].point_count);
+    vec3f_t origin = read(idx, [&] (const std::vector<vec3f_t>& points,
+                                    const std::vector<vec3f_t>& normals) {
+        for (uint32_t i = 0; i < points.size(); ++i) {
+            cloud->push_back(points[i], normals[i]);
+        }
+    });
+    cloud->set_sensor_origin(origin);
+    return cloud;
+}
+
+vec3f_t
+e57_session::read(uint32_t idx, const block_func_t& append) const {
+    if (idx >= scans_.size()) {
+        throw std::runtime_error("Scan index " + std::to_string(idx) +
+                                 " out of range");
+    }
+    if (!scans_[idx].has_normals) {
+        throw std::runtime_error("Scan " + std::to_string(idx) + " of \"" +
+                                 path_ + "\" has no normals");
+    }
+
+    try {
+        e57::ImageFile& imf = file_->imf;
+        e57::StructureNode scan = scan_node_(imf, idx);
+
+        // pose: rotation quaternion and translation, identity if missing
+        Eigen::Quaternionf rotation = Eigen::Quaternionf::Identity();
+        vec3f_t translation = vec3f_t::Zero();
+        if (scan.isDefined("pose")) {
+            e57::StructureNode pose(scan.get("pose"));
+            rotation = Eigen::Quaternionf(
+                float_value_(pose, "rotation/w", 1.0),
+                float_value_(pose, "rotation/x", 0.0),
+                float_value_(pose, "rotation/y", 0.0),
+                float_value_(pose, "rotation/z", 0.0));
+            rotation.normalize();
+            translation = vec3f_t(float_value_(pose, "translation/x", 0.0),
+                                  float_value_(pose, "translation/y", 0.0),
+                                  float_value_(pose, "translation/z", 0.0));
+        }
+        Eigen::Matrix3f rot = rotation.toRotationMatrix();
+
+        e57::CompressedVectorNode points(scan.get("points"));
+        e57::StructureNode prototype(points.prototype());
+        bool has_state = prototype.isDefined("cartesianInvalidState");
+
+        std::vector<std::vector<float>> fields(6, std::vector<float>(block_size_));
+        std::vector<int8_t> state(block_size_, 0);
+        std::vector<e57::SourceDestBuffer> buffers;
+        for (uint32_t f = 0; f < 3; ++f) {
+            buffers.emplace_back(imf, coord_fields_[f], fields[f].data(),
+                                 block_size_, true, true);
+            buffers.emplace_back(imf, normal_fields_[f], fields[3 + f].data(),
+                                 block_size_, true, true);
+        }
+        if (has_state) {
+            buffers.emplace_back(imf, "cartesianInvalidState", state.data(),
+                                 block_size_, true);
+        }
+
+        std::vector<vec3f_t> block_points, block_normals;
+        block_points.reserve(block_size_);
+        block_normals.reserve(block_size_);
+        e57::CompressedVectorReader reader = points.reader(buffers);
+        for (unsigned count = reader.read(); count; count = reader.read()) {
+            block_points.clear();
+            block_normals.clear();
+            for (unsigned i = 0; i < count; ++i) {
+                if (state[i]) continue;
+                vec3f_t p(fields[0][i], fields[1][i], fields[2][i]);
+                vec3f_t n(fields[3][i], fields[4][i], fields[5][i]);
+                block_points.push_back(rot * p + translation);
+                block_normals.push_back(rot * n);
+            }
+            append(block_points, block_normals);
+        }
+        reader.close();
+        return translation;
+    } catch (e57::E57Exception& e) {
+        throw error_(path_, e);
+    }
+}
+
+}  // duraark_compress
@@ -0,0 +1,474 @@
+#include <global_data.hpp>
+
+#include <cstring>
+#include <sstream>
+
+#include <zlib.h>
+
+#include <cereal/archives/binary.hpp>
+
+#include <octahedral.hpp>
+
+namespace duraark_compress {
+
+using pcl_compress::chunk_t;
+using pcl_compress::merged_global_data_t;
+
+static const char magic_[4] = {'D', 'G', 'D', '2'};
+static const uint32_t quant_max_ = (1u << 20) - 1;
+// deflate does not compress better than about 1:1032
+static const uint64_t max_deflate_ratio_ = 1032;
+// the legacy cereal table takes well below 1 KiB per patch
+static const uint64_t max_legacy_size_ = 1ull << 30;
+
+enum base_flags_ : uint8_t { base_mirrored = 1, base_raw = 2 };
+
+class byte_writer_ {
+public:
+    void put_u8(uint8_t v) { data_.push_back(v); }
+
+    void put_u16(uint16_t v) {
+        put_u8(v & 0xff);
+        put_u8(v >> 8);
+    }
+
+    void put_u32(uint32_t v) {
+        put_u16(v & 0xffff);
+        put_u16(v >> 16);
+    }
+
+    void put_varint(uint64_t v) {
+        while (v >= 0x80) {
+            put_u8(static_cast<uint8_t>(v) | 0x80);
+            v >>= 7;
+        }
+        put_u8(static_cast<uint8_t>(v));
+    }
+
+    void put_svarint(int64_t v) {
+        put_varint((static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+    }
+
+    void put_float(float v) {
+        uint32_t bits;
+        std::memcpy(&bits, &v, sizeof(float));
+        put_u32(bits);
+    }
+
+    void put_vec3(const vec3f_t& v) {
+        for (int i = 0; i < 3; ++i) put_float(v[i]);
+    }
+
+    void put_bbox(const bbox3f_t& bbox) {
+        put_vec3(bbox.min());
+        put_vec3(bbox.max());
+    }
+
+    const std::vector<uint8_t>& data() const { return data_; }
+
+protected:
+    std::vector<uint8_t> data_;
+};
+
+class byte_reader_ {
+public:
+    byte_reader_(const uint8_t* begin, const uint8_t* end)
+        : cur_(begin), end_(end) {}
+
+    uint8_t u8() {
+        if (cur_ == end_) {
+            throw std::runtime_error("Truncated global data");
+        }
+        return *cur_++;
+    }
+
+    uint16_t u16() {
+        uint16_t lo = u8();
+        return lo | (static_cast<uint16_t>(u8()) << 8);
+    }
+
+    uint32_t u32() {
+        uint32_t lo = u16();
+        return lo | (static_cast<uint32_t>(u16()) << 16);
+    }
+
+    uint64_t varint() {
+        uint64_t v = 0;
+        for (uint32_t shift = 0; shift < 64; shift += 7) {
+            uint8_t byte = u8();
+            v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return v;
+        }
+        throw std::runtime_error("Malformed varint in global data");
+    }
+
+    int64_t svarint() {
+        uint64_t v = varint();
+        return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+    }
+
+    float f32() {
+        uint32_t bits = u32();
+        float v;
+        std::memcpy(&v, &bits, sizeof(float));
+        return v;
+    }
+
+    vec3f_t vec3() {
+        vec3f_t v;
+        for (int i = 0; i < 3; ++i) v[i] = f32();
+        return v;
+    }
+
+    bbox3f_t bbox() {
+        vec3f_t min = vec3();
+        vec3f_t max = vec3();
+        return bbox3f_t(min, max);
+    }
+
+    const uint8_t* position() const { return cur_; }
+
+protected:
+    const uint8_t* cur_;
+    const uint8_t* end_;
+};
+
+static uint32_t
+quantize_(float v, float lo, float hi) {
+    if (!(hi > lo)) return 0;
+    float t = std::min(1.f, std::max(0.f, (v - lo) / (hi - lo)));
+    return static_cast<uint32_t>(std::round(t * quant_max_));
+}
+
+static float
+dequantize_(uint32_t q, float lo, float hi) {
+    if (!(hi > lo)) return lo;
+    return lo + (hi - lo) * (static_cast<float>(q) / quant_max_);
+}
+
+static void
+put_quantized_(byte_writer_& w, const vec3f_t& v, const bbox3f_t& bounds,
+               int64_t* prev) {
+    for (int i = 0; i < 3; ++i) {
+        int64_t q = quantize_(v[i], bounds.min()[i], bounds.max()[i]);
+        w.put_svarint(q - prev[i]);
+        prev[i] = q;
+    }
+}
+
+static vec3f_t
+get_quantized_(byte_reader_& r, const bbox3f_t& bounds, int64_t* prev) {
+    vec3f_t v;
+    for (int i = 0; i < 3; ++i) {
+        prev[i] += r.svarint();
+        if (prev[i] < 0 || prev[i] > quant_max_) {
+            throw std::runtime_error("Quantized value out of range in global data");
+        }
+        v[i] = dequantize_(static_cast<uint32_t>(prev[i]), bounds.min()[i],
+                           bounds.max()[i]);
+    }
+    return v;
+}
+
+// tangent frame all base rotations are measured against
+static void
+reference_frame_(const vec3f_t& normal, vec3f_t& tangent, vec3f_t& bitangent) {
+    vec3f_t helper =
+        (1.f - fabs(normal[2])) < Eigen::NumTraits<float>::dummy_precision()
+            ? vec3f_t::UnitX()
+            : vec3f_t::UnitZ();
+    tangent = normal.cross(helper).normalized();
+    bitangent = normal.cross(tangent);
+}
+
+static void
+put_base_(byte_writer_& w, const base_t& base) {
+    bool orthonormal =
+        (base * base.transpose() - base_t::Identity()).cwiseAbs().maxCoeff() <
+        1e-3f;
+    if (!orthonormal) {
+        w.put_u8(base_raw);
+        for (int i = 0; i < 9; ++i) w.put_float(base.data()[i]);
+        return;
+    }
+
+    vec3f_t r0 = base.row(0), r1 = base.row(1), r2 = base.row(2);
+    uint8_t flags = r2.cross(r0).dot(r1) < 0.f ? base_mirrored : 0;
+    uint32_t normal_code = oct_encode(r2);
+
+    // measure rotation against the frame of the *decoded* normal
+    vec3f_t tangent, bitangent;
+    reference_frame_(oct_decode(normal_code), tangent, bitangent);
+    float angle = std::atan2(r0.dot(bitangent), r0.dot(tangent));
+    uint32_t angle_code = static_cast<uint32_t>(
+        std::round((angle + M_PI) / (2.0 * M_PI) * 65535.0));
+
+    w.put_u8(flags);
+    w.put_u32(normal_code);
+    w.put_u16(static_cast<uint16_t>(std::min(angle_code, 65535u)));
+}
+
+static base_t
+get_base_(byte_reader_& r) {
+    base_t base;
+    uint8_t flags = r.u8();
+    if (flags & base_raw) {
+        for (int i = 0; i < 9; ++i) base.data()[i] = r.f32();
+        return base;
+    }
+
+    vec3f_t normal = oct_decode(r.u32());
+    float angle = static_cast<float>(r.u16() / 65535.0 * 2.0 * M_PI - M_PI);
+    vec3f_t tangent, bitangent;
+    reference_frame_(normal, tangent, bitangent);
+    vec3f_t r0 = std::cos(angle) * tangent + std::sin(angle) * bitangent;
+    vec3f_t r1 = normal.cross(r0);
+    if (flags & base_mirrored) r1 = -r1;
+    base.row(0) = r0;
+    base.row(1) = r1;
+    base.row(2) = normal;
+    return base;
+}
+
+// Inflates the legacy chunk (a cereal binary archive deflated by
+// pcl_compress::zlib_compress_object). The stream has to be complete and of
+// plausible size before cereal allocates anything.
+static std::string
+inflate_legacy_global_data_(const chunk_t& chunk) {
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    // 15 + 32: accept zlib and gzip headers
+    if (inflateInit2(&stream, 15 + 32) != Z_OK) {
+        throw std::runtime_error("Unable to inflate global data");
+    }
+    uint64_t limit = std::min(max_legacy_size_,
+                              max_deflate_ratio_ * chunk.size() + 64);
+    std::string raw;
+    std::vector<uint8_t> buffer(1 << 16);
+    stream.next_in = const_cast<uint8_t*>(
+        reinterpret_cast<const uint8_t*>(chunk.data()));
+    stream.avail_in = chunk.size();
+    int status = Z_OK;
+    while (status == Z_OK) {
+        stream.next_out = buffer.data();
+        stream.avail_out = buffer.size();
+        status = inflate(&stream, Z_NO_FLUSH);
+        if (stream.total_out > limit) status = Z_MEM_ERROR;
+        raw.append(reinterpret_cast<const char*>(buffer.data()),
+                   buffer.size() - stream.avail_out);
+        if (status == Z_BUF_ERROR && stream.avail_in == 0) break;
+    }
+    inflateEnd(&stream);
+    if (status != Z_STREAM_END) {
+        throw std::runtime_error("Invalid legacy global data");
+    }
+    return raw;
+}
+
+bool
+is_compact_global_data(const chunk_t& chunk) {
+    return chunk.size() >= sizeof(magic_) &&
+           std::equal(magic_, magic_ + sizeof(magic_),
+                      reinterpret_cast<const char*>(chunk.data()));
+}
+
+void
+encode_global_data(const merged_global_data_t& gdata, chunk_t& chunk) {
+    uint32_t scan_count = gdata.patch_counts.size();
+    uint64_t patch_count = 0;
+    for (const auto& count : gdata.patch_counts) patch_count += count;
+    if (patch_count != gdata.origins.size() ||
+        patch_count != gdata.bboxes.size() ||
+        patch_count != gdata.bases.size() ||
+        patch_count != gdata.point_counts.size()) {
+        throw std::runtime_error("Inconsistent global data table");
+    }
+
+    byte_writer_ w;
+    w.put_varint(scan_count);
+    uint32_t begin = 0;
+    for (uint32_t scan = 0; scan < scan_count; ++scan) {
+        uint32_t end = begin + gdata.patch_counts[scan];
+        w.put_varint(gdata.scan_indices[scan]);
+        w.put_varint(gdata.patch_counts[scan]);
+        w.put_vec3(gdata.scan_origins[scan]);
+
+        // bbs_o and bbs_b double as quantization bounds, extended in case
+        // they do not contain every value of the scan
+        bbox3f_t origin_bounds = gdata.bbs_o[scan];
+        bbox3f_t bbox_bounds = gdata.bbs_b[scan];
+        for (uint32_t i = begin; i < end; ++i) {
+            origin_bounds.extend(gdata.origins[i]);
+            bbox_bounds.extend(gdata.bboxes[i]);
+        }
+        w.put_bbox(origin_bounds);
+        w.put_bbox(bbox_bounds);
+
+        // columns: point counts, origins, bboxes, bases
+        for (uint32_t i = begin; i < end; ++i) {
+            w.put_varint(gdata.point_counts[i]);
+        }
+        int64_t prev[3] = {0, 0, 0};
+        for (uint32_t i = begin; i < end; ++i) {
+            put_quantized_(w, gdata.origins[i], origin_bounds, prev);
+        }
+        int64_t prev_min[3] = {0, 0, 0}, prev_max[3] = {0, 0, 0};
+        for (uint32_t i = begin; i < end; ++i) {
+            put_quantized_(w, gdata.bboxes[i].min(), bbox_bounds, prev_min);
+            put_quantized_(w, gdata.bboxes[i].max(), bbox_bounds, prev_max);
+        }
+        for (uint32_t i = begin; i < end; ++i) {
+            put_base_(w, gdata.bases[i]);
+        }
+        begin = end;
+    }
+
+    const std::vector<uint8_t>& raw = w.data();
+    uLongf compr_length = compressBound(raw.size());
+    std::vector<uint8_t> compr(compr_length);
+    if (compress2(compr.data(), &compr_length, raw.data(), raw.size(),
+                  Z_BEST_COMPRESSION) != Z_OK) {
+        throw std::runtime_error("Unable to deflate global data");
+    }
+
+    byte_writer_ header;
+    header.put_varint(raw.size());
+    chunk.clear();
+    chunk.insert(chunk.end(), magic_, magic_ + sizeof(magic_));
+    chunk.insert(chunk.end(), header.data().begin(), header.data().end());
+    chunk.insert(chunk.end(), compr.begin(), compr.begin() + compr_length);
+}
+
+merged_global_data_t
+decode_global_data(const chunk_t& chunk) {
+    if (!is_compact_global_data(chunk)) {
+        std::istringstream raw(inflate_legacy_global_data_(chunk));
+        merged_global_data_t gdata;
+        try {
+            cereal::BinaryInputArchive ar(raw);
+            ar(gdata);
+            return gdata;
+        } catch (std::bad_alloc&) {
+            // vector lengths are read before the data, corrupt ones end here
+            throw std::runtime_error("Invalid table size in legacy global data");
+        } catch (std::length_error&) {
+            throw std::runtime_error("Invalid table size in legacy global data");
+        }
+    }
+
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(chunk.data());
+    byte_reader_ header(data + sizeof(magic_), data + chunk.size());
+    uLongf raw_length = header.varint();
+    const uint8_t* compr = header.position();
+    if (raw_length > max_deflate_ratio_ * (data + chunk.size() - compr) + 64) {
+        throw std::runtime_error("Invalid global data size");
+    }
+    std::vector<uint8_t> raw(raw_length);
+    uLongf length = raw_length;
+    if (uncompress(raw.data(), &length, compr,
+                   data + chunk.size() - compr) != Z_OK ||
+        length != raw_length) {
+        throw std::runtime_error("Unable to inflate global data");
+    }
+
+    merged_global_data_t gdata;
+    byte_reader_ r(raw.data(), raw.data() + raw.size());
+    uint64_t scan_count = r.varint();
+    for (uint64_t scan = 0; scan < scan_count; ++scan) {
+        gdata.scan_indices.push_back(r.varint());
+        uint64_t count = r.varint();
+        // every patch takes at least one byte, reject absurd counts early
+        if (count > raw.size()) {
+            throw std::runtime_error("Invalid patch count in global data");
+        }
+        gdata.patch_counts.push_back(count);
+        gdata.scan_origins.push_back(r.vec3());
+        gdata.bbs_o.push_back(r.bbox());
+        gdata.bbs_b.push_back(r.bbox());
+        bbox3f_t origin_bounds = gdata.bbs_o.back();
+        bbox3f_t bbox_bounds = gdata.bbs_b.back();
+
+        for (uint64_t i = 0; i < count; ++i) {
+            gdata.point_counts.push_back(r.varint());
+        }
+        int64_t prev[3] = {0, 0, 0};
+        for (uint64_t i = 0; i < count; ++i) {
+            gdata.origins.push_back(get_quantized_(r, origin_bounds, prev));
+        }
+        int64_t prev_min[3] = {0, 0, 0}, prev_max[3] = {0, 0, 0};
+        for (uint64_t i = 0; i < count; ++i) {
+            vec3f_t min = get_quantized_(r, bbox_bounds, prev_min);
+            vec3f_t max = get_quantized_(r, bbox_bounds, prev_max);
+            gdata.bboxes.push_back(bbox3f_t(min, max));
+        }
+        for (uint64_t i = 0; i < count; ++i) {
+            gdata.bases.push_back(get_base_(r));
+        }
+    }
+
+    return gdata;
+}
+
+void
+append_scan_global_data(merged_global_data_t& gdata, uint32_t scan_index,
+                        const vec3f_t& scan_origin,
+                        const std::vector<pcl_compress::patch_t>& patches,
+                        const std::vector<uint32_t>& point_counts) {
+    bbox3f_t bb_o, bb_b;
+    for (const auto& patch : patches) {
+        bb_o.extend(patch.origin);
+        bb_b.extend(patch.local_bbox);
+        gdata.origins.push_back(patch.origin);
+        gdata.bboxes.push_back(patch.local_bbox);
+        gdata.bases.push_back(patch.base);
+    }
+    gdata.scan_origins.push_back(scan_origin);
+    gdata.scan_indices.push_back(scan_index);
+    gdata.patch_counts.push_back(patches.size());
+    gdata.bbs_o.push_back(bb_o);
+    gdata.bbs_b.push_back(bb_b);
+    gdata.point_counts.insert(gdata.point_counts.end(), point_counts.begin(),
+                              point_counts.end());
+}
+
+void
+validate_global_data(const merged_global_data_t& gdata, uint64_t chunk_count) {
+    uint64_t scans = gdata.patch_counts.size();
+    if (gdata.scan_origins.size() != scans || gdata.scan_indices.size() != scans ||
+        gdata.bbs_o.size() != scans || gdata.bbs_b.size() != scans) {
+        throw std::runtime_error("Inconsistent scan table in global data");
+    }
+    uint64_t patches = 0;
+    for (const auto& count : gdata.patch_counts) {
+        patches += count;
+    }
+    if (gdata.origins.size() != patches || gdata.bboxes.size() != patches ||
+        gdata.bases.size() != patches || gdata.point_counts.size() != patches) {
+        throw std::runtime_error("Inconsistent patch table in global data");
+    }
+    if (2 * patches > chunk_count) {
+        throw std::runtime_error("Archive holds fewer image chunks than patches");
+    }
+}
+
+template <typename T>
+static void
+append_all_(std::vector<T>& to, const std::vector<T>& from) {
+    to.insert(to.end(), from.begin(), from.end());
+}
+
+void
+append_global_data(merged_global_data_t& gdata,
+                   const merged_global_data_t& other) {
+    append_all_(gdata.scan_origins, other.scan_origins);
+    append_all_(gdata.scan_indices, other.scan_indices);
+    append_all_(gdata.patch_counts, other.patch_counts);
+    append_all_(gdata.bbs_o, other.bbs_o);
+    append_all_(gdata.bbs_b, other.bbs_b);
+    append_all_(gdata.point_counts, other.point_counts);
+    append_all_(gdata.origins, other.origins);
+    append_all_(gdata.bboxes, other.bboxes);
+    append_all_(gdata.bases, other.bases);
+}
+
+}  // duraark_compress
@@ -0,0 +1,141 @@
+#include <ifc.hpp>
+
+#include <fstream>
+#include <sstream>
+
+#include <boost/regex.hpp>
+
+namespace duraark_compress {
+
+ifc_mesh::ifc_mesh() {}
+
+ifc_mesh::~ifc_mesh() {}
+
+ifc_mesh::ptr_t
+ifc_mesh::load_obj(const std::string& file_obj) {
+    std::ifstream in(file_obj.c_str());
+    if (!in.good()) {
+        throw std::runtime_error("Unable to open IFC mesh file \"" + file_obj +
+                                 "\" for reading.");
+    }
+
+    ptr_t mesh(new ifc_mesh());
+    int32_t element = -1;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream tokens(line);
+        std::string tag;
+        if (!(tokens >> tag)) continue;
+
+        if (tag == "v") {
+            vec3f_t v;
+            if (!(tokens >> v[0] >> v[1] >> v[2])) {
+                throw std::runtime_error("Invalid vertex in IFC mesh file \"" + file_obj + "\"");
+            }
+            mesh->vertices_.push_back(v);
+        } else if (tag == "g" || tag == "o") {
+            std::string name;
+            tokens >> name;
+            ifc_element_t elem;
+            std::size_t sep = name.find('_');
+            if (name.compare(0, 3, "Ifc") == 0 && sep != std::string::npos) {
+                elem.type = name.substr(0, sep);
+                elem.guid = name.substr(sep + 1);
+            } else {
+                elem.guid = name;
+            }
+            // "o" and "g" statements often name the same element twice
+            if (element < 0 || mesh->elements_[element].guid != elem.guid) {
+                element = mesh->elements_.size();
+                mesh->elements_.push_back(elem);
+            }
+        } else if (tag == "f") {
+            if (element < 0) {
+                element = mesh->elements_.size();
+                mesh->elements_.push_back({"", ""});
+            }
+            std::vector<uint32_t> polygon;
+            std::string vertex;
+            while (tokens >> vertex) {
+                // "v", "v/vt", "v//vn" or "v/vt/vn", negative indices are relative
+                int32_t idx;
+                try {
+                    idx = std::stoi(vertex.substr(0, vertex.find('/')));
+                } catch (std::logic_error&) {
+                    // invalid_argument and out_of_range
+                    throw std::runtime_error("Invalid face \"" + line + "\" in IFC mesh file \"" + file_obj + "\"");
+                }
+                idx = idx < 0 ? static_cast<int32_t>(mesh->vertices_.size()) + idx
+                              : idx - 1;
+                if (idx < 0 || idx >= static_cast<int32_t>(mesh->vertices_.size())) {
+                    throw std::runtime_error("Invalid vertex index in IFC mesh file \"" + file_obj + "\"");
+                }
+                polygon.push_back(idx);
+            }
+            for (uint32_t i = 2; i < polygon.size(); ++i) {
+                mesh->faces_.push_back(
+                    {{{polygon[0], polygon[i - 1], polygon[i]}},
+                     static_cast<uint32_t>(element)});
+            }
+        }
+    }
+
+    return mesh;
+}
+
+const std::vector<ifc_element_t>&
+ifc_mesh::elements() const {
+    return elements_;
+}
+
+const std::vector<vec3f_t>&
+ifc_mesh::vertices() const {
+    return vertices_;
+}
+
+const std::vector<ifc_mesh::face_t>&
+ifc_mesh::faces() const {
+    return faces_;
+}
+
+transforms_t
+load_registration(const std::string& file_reg) {
+    std::ifstream in(file_reg.c_str());
+    if (!in.good()) {
+        throw std::runtime_error("Unable to open registration file \"" +
+                                 file_reg + "\" for reading.");
+    }
+    std::string content((std::istreambuf_iterator<char>(in)),
+                        std::istreambuf_iterator<char>());
+
+    const std::string number = "[-+]?(?:\\d+\\.?\\d*|\\.\\d+)(?:[eE][-+]?\\d+)?";
+    const std::string sep = "[\\s,;]+";
+    std::string matrix = number;
+    for (int i = 1; i < 16; ++i) matrix += sep + number;
+    // literals are enclosed in quotes or tags
+    boost::regex literal("[\">]\\s*(" + matrix + ")\\s*[\"<]");
+    boost::regex num(number);
+
+    transforms_t transforms;
+    for (boost::sregex_iterator it(content.begin(), content.end(), literal), end; it != end; ++it) {
+        std::string values = (*it)[1];
+        Eigen::Matrix4f t;
+        int i = 0;
+        for (boost::sregex_iterator n(values.begin(), values.end(), num); n != end && i < 16; ++n) {
+            try {
+                t(i / 4, i % 4) = std::stof(n->str());
+            } catch (std::out_of_range&) {
+                throw std::runtime_error("Value out of range in registration file \"" + file_reg + "\"");
+            }
+            ++i;
+        }
+        transforms.push_back(t);
+    }
+
+    if (transforms.empty()) {
+        throw std::runtime_error("No transformation found in registration file \"" + file_reg + "\"");
+    }
+    return transforms;
+}
+
+}  // duraark_compress
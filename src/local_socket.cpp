@@ -0,0 +1,213 @@
+#include <local_socket.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace duraark_compress {
+
+static const uint64_t read_size_ = 1 << 16;
+// clients are served one after another, a stalled one must not block others
+static const int client_timeout_s_ = 30;
+
+static sockaddr_un
+address_(const std::string& path) {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket path \"" + path + "\" is too long");
+    }
+    std::strcpy(address.sun_path, path.c_str());
+    return address;
+}
+
+static int
+socket_(const std::string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw std::runtime_error("Unable to create socket \"" + path + "\": " +
+                                 std::strerror(errno));
+    }
+    return fd;
+}
+
+// Removes a socket file left behind by a killed server, which would block
+// bind(). Anything else at path - regular files, symlinks, sockets of a
+// running server - is left alone and reported.
+static void
+remove_stale_socket_(const std::string& path, const sockaddr_un& address) {
+    struct stat info;
+    if (lstat(path.c_str(), &info)) {
+        if (errno == ENOENT) return;
+        throw std::runtime_error("Unable to stat socket \"" + path + "\": " +
+                                 std::strerror(errno));
+    }
+    if (!S_ISSOCK(info.st_mode)) {
+        throw std::runtime_error("\"" + path + "\" exists and is not a socket");
+    }
+    int fd = socket_(path);
+    int result = ::connect(fd, reinterpret_cast<const sockaddr*>(&address),
+                           sizeof(address));
+    int error = errno;
+    close(fd);
+    if (!result) {
+        throw std::runtime_error("Socket \"" + path +
+                                 "\" is in use by another server");
+    }
+    if (error != ECONNREFUSED) {
+        throw std::runtime_error("Unable to probe socket \"" + path + "\": " +
+                                 std::strerror(error));
+    }
+    if (unlink(path.c_str()) && errno != ENOENT) {
+        throw std::runtime_error("Unable to remove stale socket \"" + path +
+                                 "\": " + std::strerror(errno));
+    }
+}
+
+local_socket::ptr_t
+local_socket::listen(const std::string& path) {
+    sockaddr_un address = address_(path);
+    remove_stale_socket_(path, address);
+    int fd = socket_(path);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) ||
+        ::listen(fd, 16)) {
+        int error = errno;
+        close(fd);
+        throw std::runtime_error("Unable to listen on socket \"" + path +
+                                 "\": " + std::strerror(error));
+    }
+    return ptr_t(new local_socket(fd, path));
+}
+
+local_socket::ptr_t
+local_socket::connect(const std::string& path) {
+    sockaddr_un address = address_(path);
+    int fd = socket_(path);
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&address),
+                  sizeof(address))) {
+        int error = errno;
+        close(fd);
+        throw std::runtime_error("Unable to connect to socket \"" + path +
+                                 "\": " + std::strerror(error));
+    }
+    return ptr_t(new local_socket(fd));
+}
+
+local_socket::local_socket(int fd, const std::string& owned_path)
+    : fd_(fd), owned_path_(owned_path), buffer_begin_(0) {}
+
+local_socket::~local_socket() {
+    close(fd_);
+    if (!owned_path_.empty()) {
+        unlink(owned_path_.c_str());
+    }
+}
+
+local_socket::ptr_t
+local_socket::accept(int timeout_ms) {
+    pollfd request = {fd_, POLLIN, 0};
+    if (poll(&request, 1, timeout_ms) <= 0) {
+        return ptr_t();
+    }
+    int fd = ::accept(fd_, nullptr, nullptr);
+    if (fd < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == ECONNABORTED) {
+            return ptr_t();
+        }
+        throw std::runtime_error(std::string("Unable to accept client: ") +
+                                 std::strerror(errno));
+    }
+    timeval timeout = {client_timeout_s_, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return ptr_t(new local_socket(fd));
+}
+
+void
+local_socket::write(const void* data, uint64_t size) {
+    const char* begin = static_cast<const char*>(data);
+    while (size) {
+        // MSG_NOSIGNAL: a vanished client must not raise SIGPIPE
+        ssize_t written = send(fd_, begin, size, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(std::string("Unable to write to socket: ") +
+                                     std::strerror(errno));
+        }
+        begin += written;
+        size -= written;
+    }
+}
+
+void
+local_socket::write_line(const std::string& line) {
+    std::string data = line + "\n";
+    write(data.data(), data.size());
+}
+
+bool
+local_socket::read(void* data, uint64_t size) {
+    char* out = static_cast<char*>(data);
+    uint64_t done = 0;
+    while (done < size) {
+        if (buffer_begin_ == buffer_.size() && !fill_()) {
+            if (!done) return false;
+            throw std::runtime_error("Unexpected end of stream");
+        }
+        uint64_t count =
+            std::min(size - done, buffer_.size() - buffer_begin_);
+        std::memcpy(out + done, buffer_.data() + buffer_begin_, count);
+        buffer_begin_ += count;
+        done += count;
+    }
+    return true;
+}
+
+bool
+local_socket::read_line(std::string& line, uint64_t max_length) {
+    line.clear();
+    while (true) {
+        if (buffer_begin_ == buffer_.size() && !fill_()) {
+            if (line.empty()) return false;
+            throw std::runtime_error("Unexpected end of stream");
+        }
+        auto begin = buffer_.begin() + buffer_begin_;
+        auto end = std::find(begin, buffer_.end(), '\n');
+        line.append(begin, end);
+        buffer_begin_ = end - buffer_.begin();
+        if (line.size() > max_length) {
+            throw std::runtime_error("Line exceeds " +
+                                     std::to_string(max_length) + " bytes");
+        }
+        if (end != buffer_.end()) {
+            ++buffer_begin_;
+            return true;
+        }
+    }
+}
+
+bool
+local_socket::fill_() {
+    buffer_.resize(read_size_);
+    buffer_begin_ = 0;
+    while (true) {
+        ssize_t count = recv(fd_, buffer_.data(), buffer_.size(), 0);
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0) {
+            buffer_.clear();
+            throw std::runtime_error(std::string("Unable to read from socket: ") +
+                                     std::strerror(errno));
+        }
+        buffer_.resize(count);
+        return count > 0;
+    }
+}
+
+}  // duraark_compress
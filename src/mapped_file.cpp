@@ -0,0 +1,60 @@
+#include <mapped_file.hpp>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace duraark_compress {
+
+mapped_file::mapped_file(const std::string& path)
+    : path_(path), fd_(-1), data_(nullptr), size_(0) {
+    fd_ = open(path.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+        throw std::runtime_error("Unable to open file \"" + path + "\": " +
+                                 std::strerror(errno));
+    }
+    struct stat info;
+    if (fstat(fd_, &info) != 0) {
+        close(fd_);
+        throw std::runtime_error("Unable to stat file \"" + path + "\"");
+    }
+    size_ = info.st_size;
+    if (size_) {
+        void* addr = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+        if (addr == MAP_FAILED) {
+            close(fd_);
+            throw std::runtime_error("Unable to map file \"" + path + "\": " +
+                                     std::strerror(errno));
+        }
+        data_ = static_cast<const uint8_t*>(addr);
+    }
+}
+
+mapped_file::~mapped_file() {
+    if (data_) {
+        munmap(const_cast<uint8_t*>(data_), size_);
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+const std::string&
+mapped_file::path() const {
+    return path_;
+}
+
+const uint8_t*
+mapped_file::data() const {
+    return data_;
+}
+
+uint64_t
+mapped_file::size() const {
+    return size_;
+}
+
+}  // duraark_compress
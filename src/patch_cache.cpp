@@ -0,0 +1,62 @@
+#include <patch_cache.hpp>
+
+namespace duraark_compress {
+
+patch_cache::patch_cache(uint64_t byte_budget)
+    : budget_(byte_budget), bytes_used_(0), hits_(0), misses_(0) {}
+
+patch_cache::~patch_cache() {}
+
+cloud_normal_t::ConstPtr
+patch_cache::get(const key_t& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = index_.find(key);
+    if (found == index_.end()) {
+        ++misses_;
+        return cloud_normal_t::ConstPtr();
+    }
+    ++hits_;
+    entries_.splice(entries_.begin(), entries_, found->second);
+    return found->second->second;
+}
+
+void
+patch_cache::put(const key_t& key, cloud_normal_t::ConstPtr points) {
+    uint64_t bytes = bytes_(*points);
+    if (bytes > budget_) return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = index_.find(key);
+    if (found != index_.end()) {
+        // decoded concurrently by another request
+        entries_.splice(entries_.begin(), entries_, found->second);
+        return;
+    }
+    entries_.emplace_front(key, points);
+    index_[key] = entries_.begin();
+    bytes_used_ += bytes;
+    while (bytes_used_ > budget_) {
+        const entry_t& last = entries_.back();
+        bytes_used_ -= bytes_(*last.second);
+        index_.erase(last.first);
+        entries_.pop_back();
+    }
+}
+
+patch_cache::stats_t
+patch_cache::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_t stats;
+    stats.entries = entries_.size();
+    stats.bytes = bytes_used_;
+    stats.hits = hits_;
+    stats.misses = misses_;
+    return stats;
+}
+
+uint64_t
+patch_cache::bytes_(const cloud_normal_t& points) {
+    return sizeof(cloud_normal_t) + points.size() * sizeof(point_normal_t);
+}
+
+}  // duraark_compress
@@ -0,0 +1,515 @@
+#include <patch_codec.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <tuple>
+
+#include <cancellation.hpp>
+#include <checksum.hpp>
+
+#include <pcl_compress/decompress.hpp>
+#include <pcl_compress/jbig2.hpp>
+#include <pcl_compress/jpeg2000.hpp>
+
+namespace duraark_compress {
+
+using pcl_compress::chunk_t;
+using pcl_compress::chunk_ptr_t;
+
+// neither a JBIG2 nor a JPEG2000 stream starts like this
+static const char constant_tag_[4] = {'C', 'I', 'M', 'G'};
+static const std::size_t constant_chunk_size_ =
+    sizeof(constant_tag_) + 3 * sizeof(int32_t) + sizeof(double);
+static const char atlas_tag_[4] = {'A', 'T', 'L', 'S'};
+static const std::size_t atlas_chunk_size_ =
+    sizeof(atlas_tag_) + sizeof(uint32_t) + 4 * sizeof(int32_t);
+// decoded atlases kept per thread; atlases of one scan are consecutive
+static const uint32_t max_cached_atlases_ = 4;
+// patch images are img_size^2 (8 to 64 by default); larger constant images
+// only come from corrupt chunks
+static const int32_t max_image_size_ = 4096;
+static const uint64_t max_reserved_points_ = 1ull << 24;
+// pixels of edge replication around every height map in an atlas, keeps
+// most of the wavelet ringing of neighbouring tiles out of the patch
+static const int32_t height_gutter_ = 4;
+
+static const cv::Mat&
+image_(const pcl_compress::patch_t& patch, uint32_t kind) {
+    return kind ? patch.height_map : patch.occ_map;
+}
+
+// Peak signal to noise ratio of decoded against original in dB, the measure
+// the JPEG2000 quality setting (OpenJPEG distortion ratio) targets.
+static double
+psnr_(const cv::Mat& original, const cv::Mat& decoded) {
+    double peak;
+    int depth = CV_MAT_DEPTH(original.type());
+    if (depth == CV_8U) {
+        peak = 255.0;
+    } else if (depth == CV_16U) {
+        peak = 65535.0;
+    } else {
+        double min, max;
+        cv::minMaxLoc(original, &min, &max);
+        peak = max - min;
+    }
+    double error = cv::norm(original, decoded, cv::NORM_L2);
+    double mse = error * error / original.total();
+    if (mse <= 0.0) return std::numeric_limits<double>::infinity();
+    return 10.0 * std::log10(peak * peak / mse);
+}
+
+// Called concurrently. pcl_compress sets up a separate jbig2enc context and
+// OpenJPEG codec per image and shares no encoder state between calls.
+static void
+encode_image_(const cv::Mat& img, uint32_t kind, uint32_t quality,
+              chunk_t& chunk) {
+    if (kind) {
+        chunk.swap(*pcl_compress::jpeg2000_compress_image(img, quality));
+    } else {
+        chunk.swap(*pcl_compress::jbig2_compress_image(img));
+    }
+}
+
+std::vector<chunk_t>
+encode_patch_images(const std::vector<pcl_compress::patch_t>& patches,
+                    uint32_t quality) {
+    std::vector<chunk_t> chunks(patches.size() * 2);
+    parallel_error error;
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (uint32_t i = 0; i < patches.size(); ++i) {
+        if (cancel_requested() || error.failed()) continue;
+        try {
+            for (uint32_t kind = 0; kind < 2; ++kind) {
+                const cv::Mat& img = image_(patches[i], kind);
+                double value;
+                if (is_constant_image(img, value)) {
+                    encode_constant_chunk(img, value, chunks[i * 2 + kind]);
+                } else {
+                    encode_image_(img, kind, quality, chunks[i * 2 + kind]);
+                }
+            }
+        } catch (...) {
+            error.capture();
+        }
+    }
+    error.rethrow();
+    checkpoint();
+    return chunks;
+}
+
+std::vector<chunk_t>
+encode_patch_images_atlas(const std::vector<pcl_compress::patch_t>& patches,
+                          uint32_t quality, uint32_t atlas_size,
+                          std::vector<chunk_t>& atlas_chunks) {
+    std::vector<chunk_t> chunks(patches.size() * 2);
+    std::vector<uint8_t> constant(patches.size() * 2, 0);
+    parallel_error error;
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (uint32_t i = 0; i < patches.size() * 2; ++i) {
+        if (error.failed()) continue;
+        try {
+            const cv::Mat& img = image_(patches[i / 2], i % 2);
+            double value;
+            if (is_constant_image(img, value)) {
+                encode_constant_chunk(img, value, chunks[i]);
+                constant[i] = 1;
+            }
+        } catch (...) {
+            error.capture();
+        }
+    }
+    error.rethrow();
+
+    for (uint32_t kind = 0; kind < 2; ++kind) {
+        // images of equal size and type share atlases, images that do not
+        // fit into an atlas are encoded on their own. Height maps are
+        // lossy: they are tiled with a replicated gutter, and every tile
+        // whose decoded quality falls below the requested one is encoded on
+        // its own afterwards.
+        const int32_t gutter = kind ? height_gutter_ : 0;
+        std::map<std::tuple<int32_t, int32_t, int32_t>, std::vector<uint32_t>> layouts;
+        std::vector<uint32_t> single;
+        for (uint32_t i = 0; i < patches.size(); ++i) {
+            if (constant[i * 2 + kind]) continue;
+            const cv::Mat& img = image_(patches[i], kind);
+            bool fits = img.cols + 2 * gutter <= static_cast<int>(atlas_size) &&
+                        img.rows + 2 * gutter <= static_cast<int>(atlas_size);
+            if (fits) {
+                layouts[std::make_tuple(img.rows, img.cols, img.type())].push_back(i);
+            } else {
+                single.push_back(i);
+            }
+        }
+
+        #pragma omp parallel for schedule(dynamic, 16)
+        for (uint32_t i = 0; i < single.size(); ++i) {
+            if (cancel_requested() || error.failed()) continue;
+            try {
+                encode_image_(image_(patches[single[i]], kind), kind, quality,
+                              chunks[single[i] * 2 + kind]);
+            } catch (...) {
+                error.capture();
+            }
+        }
+        error.rethrow();
+
+        for (const auto& layout : layouts) {
+            const std::vector<uint32_t>& tiled = layout.second;
+            const cv::Mat& first = image_(patches[tiled[0]], kind);
+            const int32_t pitch_cols = first.cols + 2 * gutter;
+            const int32_t pitch_rows = first.rows + 2 * gutter;
+            uint32_t max_cols = atlas_size / pitch_cols;
+            uint32_t max_rows = atlas_size / pitch_rows;
+            uint32_t per_atlas = max_cols * max_rows;
+            uint32_t atlas_count = (tiled.size() + per_atlas - 1) / per_atlas;
+            uint32_t first_atlas = atlas_chunks.size();
+            atlas_chunks.resize(first_atlas + atlas_count);
+
+            #pragma omp parallel for schedule(dynamic, 1)
+            for (uint32_t a = 0; a < atlas_count; ++a) {
+                if (cancel_requested() || error.failed()) continue;
+                try {
+                    uint32_t begin = a * per_atlas;
+                    uint32_t count = std::min(per_atlas,
+                                              static_cast<uint32_t>(tiled.size()) - begin);
+                    // the last atlas shrinks to the rows it actually uses
+                    uint32_t cols = std::min(max_cols, count);
+                    uint32_t rows = (count + cols - 1) / cols;
+                    cv::Mat atlas = cv::Mat::zeros(rows * pitch_rows, cols * pitch_cols,
+                                                   first.type());
+                    std::vector<cv::Rect> rects(count);
+                    for (uint32_t t = 0; t < count; ++t) {
+                        uint32_t idx = tiled[begin + t];
+                        cv::Rect cell((t % cols) * pitch_cols, (t / cols) * pitch_rows,
+                                      pitch_cols, pitch_rows);
+                        rects[t] = cv::Rect(cell.x + gutter, cell.y + gutter,
+                                            first.cols, first.rows);
+                        if (gutter) {
+                            cv::copyMakeBorder(image_(patches[idx], kind), atlas(cell),
+                                               gutter, gutter, gutter, gutter,
+                                               cv::BORDER_REPLICATE);
+                        } else {
+                            image_(patches[idx], kind).copyTo(atlas(rects[t]));
+                        }
+                        encode_atlas_reference(first_atlas + a, rects[t],
+                                               chunks[idx * 2 + kind]);
+                    }
+                    chunk_t& atlas_chunk = atlas_chunks[first_atlas + a];
+                    encode_image_(atlas, kind, quality, atlas_chunk);
+                    if (!kind) continue;
+
+                    // measure what the decoder gets back for every tile
+                    chunk_ptr_t buffer(new chunk_t(atlas_chunk));
+                    cv::Mat decoded = pcl_compress::jpeg2000_decompress_chunk(buffer);
+                    bool comparable = decoded.size() == atlas.size() &&
+                                      decoded.type() == atlas.type();
+                    for (uint32_t t = 0; t < count; ++t) {
+                        uint32_t idx = tiled[begin + t];
+                        const cv::Mat& img = image_(patches[idx], kind);
+                        if (!comparable || psnr_(img, decoded(rects[t])) < quality) {
+                            encode_image_(img, kind, quality, chunks[idx * 2 + kind]);
+                        }
+                    }
+                } catch (...) {
+                    error.capture();
+                }
+            }
+            error.rethrow();
+        }
+        checkpoint();
+    }
+    return chunks;
+}
+
+patch_decoder&
+patch_decoder::local() {
+    thread_local patch_decoder decoder;
+    return decoder;
+}
+
+patch_decoder::patch_decoder()
+    : occ_buffer_(new chunk_t()),
+      height_buffer_(new chunk_t()),
+      atlas_source_(nullptr) {}
+
+patch_decoder::~patch_decoder() {}
+
+void
+patch_decoder::decode_images(const chunk_t& occ_chunk,
+                             const chunk_t& height_chunk,
+                             pcl_compress::patch_t& patch) {
+    decode_image_(occ_chunk, nullptr, 0, true, cv::Size(), patch.occ_map);
+    decode_image_(height_chunk, nullptr, 0, false, patch.occ_map.size(),
+                  patch.height_map);
+}
+
+void
+patch_decoder::decode_images(const pcl_compress::compressed_cloud_t& cc,
+                             uint32_t patch_count, uint32_t idx,
+                             pcl_compress::patch_t& patch) {
+    chunk_source_t source = source_(cc);
+    if (idx >= patch_count || 2ull * patch_count > source.count) {
+        throw std::runtime_error("Patch index out of range");
+    }
+    decode_image_(cc.patch_image_data[idx * 2 + 0], &source, patch_count, true,
+                  cv::Size(), patch.occ_map);
+    decode_image_(cc.patch_image_data[idx * 2 + 1], &source, patch_count,
+                  false, patch.occ_map.size(), patch.height_map);
+}
+
+void
+patch_decoder::decode_images(const chunk_source_t& source,
+                             uint32_t patch_count, uint32_t idx,
+                             pcl_compress::patch_t& patch) {
+    if (idx >= patch_count || 2ull * patch_count > source.count) {
+        throw std::runtime_error("Patch index out of range");
+    }
+    source.fetch(2ull * idx + 0, fetched_);
+    decode_image_(fetched_, &source, patch_count, true, cv::Size(),
+                  patch.occ_map);
+    source.fetch(2ull * idx + 1, fetched_);
+    decode_image_(fetched_, &source, patch_count, false, patch.occ_map.size(),
+                  patch.height_map);
+}
+
+void
+patch_decoder::clear_cache() {
+    atlases_.clear();
+    atlas_order_.clear();
+    atlas_source_ = nullptr;
+}
+
+void
+patch_decoder::decode_points(const pcl_compress::compressed_cloud_t& cc,
+                             const pcl_compress::merged_global_data_t& gdata,
+                             const std::vector<uint32_t>& patches,
+                             cloud_normal_t& cloud, uint32_t batch_size) {
+    uint64_t expected = cloud.size();
+    for (const auto& idx : patches) {
+        expected += gdata.point_counts[idx];
+    }
+    // point counts come from the archive, do not trust them for allocations
+    cloud.reserve(std::min(expected, cloud.size() + max_reserved_points_));
+
+    batch_size = std::max(1u, batch_size);
+    for (uint32_t begin = 0; begin < patches.size(); begin += batch_size) {
+        uint32_t end = std::min(begin + batch_size,
+                                static_cast<uint32_t>(patches.size()));
+        // resize() would free the images of patches beyond a smaller batch
+        while (batch_.size() > end - begin) {
+            spare_.push_back(std::move(batch_.back()));
+            batch_.pop_back();
+        }
+        while (batch_.size() < end - begin && !spare_.empty()) {
+            batch_.push_back(std::move(spare_.back()));
+            spare_.pop_back();
+        }
+        batch_.resize(end - begin);
+        for (uint32_t i = begin; i < end; ++i) {
+            uint32_t idx = patches[i];
+            pcl_compress::patch_t& patch = batch_[i - begin];
+            patch.origin = gdata.origins[idx];
+            patch.local_bbox = gdata.bboxes[idx];
+            patch.base = gdata.bases[idx];
+            decode_images(cc, gdata.origins.size(), idx, patch);
+        }
+        cloud_normal_t::Ptr points = pcl_compress::from_patches(batch_);
+        cloud.insert(cloud.end(), points->begin(), points->end());
+    }
+}
+
+void
+patch_decoder::decode_image_(const chunk_t& chunk,
+                             const chunk_source_t* source,
+                             uint32_t patch_count, bool occupancy,
+                             const cv::Size& size, cv::Mat& img) {
+    uint32_t atlas_id;
+    cv::Rect rect;
+    if (decode_constant_chunk(chunk, img, size)) {
+        // size is checked before the image is allocated
+    } else if (decode_atlas_reference(chunk, atlas_id, rect)) {
+        if (!source) {
+            throw std::runtime_error(
+                "Atlas references can only be decoded from an archive");
+        }
+        // atlases lie between the patch chunks and the checksum chunk, which
+        // source->count excludes
+        uint64_t chunk_idx = 2ull * patch_count + atlas_id;
+        if (chunk_idx >= source->count) {
+            throw std::runtime_error("Atlas reference out of range");
+        }
+        const cv::Mat& atlas = atlas_(*source, chunk_idx, occupancy);
+        if ((rect & cv::Rect(0, 0, atlas.cols, atlas.rows)) != rect) {
+            throw std::runtime_error("Atlas reference exceeds atlas bounds");
+        }
+        // reuses the storage of img for equal size and type
+        atlas(rect).copyTo(img);
+    } else {
+        // the codecs always return newly allocated images
+        img = decode_codec_(chunk, occupancy);
+    }
+
+    // the height map has to cover the occupancy map pixel by pixel
+    if (size.area() && img.size() != size) {
+        throw std::runtime_error("Height map size differs from occupancy map");
+    }
+}
+
+cv::Mat
+patch_decoder::decode_codec_(const chunk_t& chunk, bool occupancy) {
+    // assign() keeps the buffer capacity of previous patches
+    if (occupancy) {
+        occ_buffer_->assign(chunk.begin(), chunk.end());
+    } else {
+        height_buffer_->assign(chunk.begin(), chunk.end());
+    }
+    return decode_buffer_(occupancy);
+}
+
+cv::Mat
+patch_decoder::decode_buffer_(bool occupancy) {
+    if (occupancy) {
+        return pcl_compress::jbig2_decompress_chunk(occ_buffer_);
+    }
+    return pcl_compress::jpeg2000_decompress_chunk(height_buffer_);
+}
+
+const cv::Mat&
+patch_decoder::atlas_(const chunk_source_t& source, uint64_t chunk_idx,
+                      bool occupancy) {
+    if (atlas_source_ != source.key) {
+        clear_cache();
+        atlas_source_ = source.key;
+    }
+    auto found = atlases_.find(chunk_idx);
+    if (found != atlases_.end()) {
+        atlas_order_.splice(atlas_order_.begin(), atlas_order_,
+                            std::find(atlas_order_.begin(),
+                                      atlas_order_.end(), chunk_idx));
+        return found->second;
+    }
+    if (atlases_.size() >= max_cached_atlases_) {
+        atlases_.erase(atlas_order_.back());
+        atlas_order_.pop_back();
+    }
+    // atlases are fetched straight into the codec buffer
+    source.fetch(chunk_idx, occupancy ? *occ_buffer_ : *height_buffer_);
+    cv::Mat atlas = decode_buffer_(occupancy);
+    atlas_order_.push_front(chunk_idx);
+    return atlases_[chunk_idx] = atlas;
+}
+
+chunk_source_t
+patch_decoder::source_(const pcl_compress::compressed_cloud_t& cc) {
+    chunk_source_t source;
+    source.key = &cc;
+    source.count = data_chunk_count(cc);
+    source.fetch = [&cc] (uint64_t idx, chunk_t& chunk) {
+        chunk.assign(cc.patch_image_data[idx].begin(),
+                     cc.patch_image_data[idx].end());
+    };
+    return source;
+}
+
+void
+decode_patch_images(const chunk_t& occ_chunk, const chunk_t& height_chunk,
+                    pcl_compress::patch_t& patch) {
+    patch_decoder::local().decode_images(occ_chunk, height_chunk, patch);
+}
+
+bool
+is_constant_image(const cv::Mat& img, double& value) {
+    if (img.empty()) return false;
+    double min, max;
+    cv::minMaxLoc(img.reshape(1), &min, &max);
+    value = min;
+    return min == max;
+}
+
+void
+encode_constant_chunk(const cv::Mat& img, double value, chunk_t& chunk) {
+    int32_t header[3] = {img.rows, img.cols, img.type()};
+    chunk.resize(constant_chunk_size_);
+    uint8_t* out = reinterpret_cast<uint8_t*>(chunk.data());
+    std::memcpy(out, constant_tag_, sizeof(constant_tag_));
+    std::memcpy(out + sizeof(constant_tag_), header, sizeof(header));
+    std::memcpy(out + sizeof(constant_tag_) + sizeof(header), &value,
+                sizeof(double));
+}
+
+bool
+decode_constant_chunk(const chunk_t& chunk, cv::Mat& img,
+                      const cv::Size& size) {
+    if (chunk.size() != constant_chunk_size_ ||
+        std::memcmp(chunk.data(), constant_tag_, sizeof(constant_tag_))) {
+        return false;
+    }
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(chunk.data());
+    int32_t header[3];
+    double value;
+    std::memcpy(header, in + sizeof(constant_tag_), sizeof(header));
+    std::memcpy(&value, in + sizeof(constant_tag_) + sizeof(header),
+                sizeof(double));
+    if (header[0] <= 0 || header[1] <= 0 || header[0] > max_image_size_ ||
+        header[1] > max_image_size_) {
+        throw std::runtime_error("Invalid constant image size");
+    }
+    if (size.area() && cv::Size(header[1], header[0]) != size) {
+        throw std::runtime_error("Constant image size differs from patch");
+    }
+    // patch images are single channel 8 bit, 16 bit or float images
+    int depth = CV_MAT_DEPTH(header[2]);
+    if (header[2] < 0 || CV_MAT_CN(header[2]) != 1 ||
+        (depth != CV_8U && depth != CV_16U && depth != CV_32F)) {
+        throw std::runtime_error("Invalid constant image type");
+    }
+    img.create(header[0], header[1], header[2]);
+    img.setTo(cv::Scalar::all(value));
+    return true;
+}
+
+void
+rebase_atlas_references(std::vector<chunk_t>& chunks, uint32_t offset) {
+    if (!offset) return;
+    for (auto& chunk : chunks) {
+        uint32_t atlas;
+        cv::Rect rect;
+        if (decode_atlas_reference(chunk, atlas, rect)) {
+            encode_atlas_reference(atlas + offset, rect, chunk);
+        }
+    }
+}
+
+void
+encode_atlas_reference(uint32_t atlas, const cv::Rect& rect, chunk_t& chunk) {
+    int32_t header[4] = {rect.x, rect.y, rect.width, rect.height};
+    chunk.resize(atlas_chunk_size_);
+    uint8_t* out = reinterpret_cast<uint8_t*>(chunk.data());
+    std::memcpy(out, atlas_tag_, sizeof(atlas_tag_));
+    std::memcpy(out + sizeof(atlas_tag_), &atlas, sizeof(uint32_t));
+    std::memcpy(out + sizeof(atlas_tag_) + sizeof(uint32_t), header,
+                sizeof(header));
+}
+
+bool
+decode_atlas_reference(const chunk_t& chunk, uint32_t& atlas, cv::Rect& rect) {
+    if (chunk.size() != atlas_chunk_size_ ||
+        std::memcmp(chunk.data(), atlas_tag_, sizeof(atlas_tag_))) {
+        return false;
+    }
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(chunk.data());
+    int32_t header[4];
+    std::memcpy(&atlas, in + sizeof(atlas_tag_), sizeof(uint32_t));
+    std::memcpy(header, in + sizeof(atlas_tag_) + sizeof(uint32_t),
+                sizeof(header));
+    if (header[2] <= 0 || header[3] <= 0) {
+        throw std::runtime_error("Invalid atlas reference chunk");
+    }
+    rect = cv::Rect(header[0], header[1], header[2], header[3]);
+    return true;
+}
+
+}  // duraark_compress
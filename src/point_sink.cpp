@@ -0,0 +1,210 @@
+#include <point_sink.hpp>
+
+#include <cstdio>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+
+#include <e57_pcl/write.hpp>
+
+#include <atomic_file.hpp>
+
+namespace duraark_compress {
+
+static void
+write_records_(std::ofstream& out, cloud_normal_t::ConstPtr cloud) {
+    std::vector<float> buffer(cloud->size() * 6);
+    float* rec = buffer.data();
+    for (const auto& p : cloud->points) {
+        rec[0] = p.x;
+        rec[1] = p.y;
+        rec[2] = p.z;
+        rec[3] = p.normal_x;
+        rec[4] = p.normal_y;
+        rec[5] = p.normal_z;
+        rec += 6;
+    }
+    out.write(reinterpret_cast<const char*>(buffer.data()),
+              buffer.size() * sizeof(float));
+    if (!out.good()) {
+        throw std::runtime_error("Unable to write decompressed points");
+    }
+}
+
+point_sink::~point_sink() {}
+
+void
+point_sink::begin_scan(uint32_t, const vec3f_t&) {}
+
+void
+point_sink::end_scan() {}
+
+uint64_t
+point_sink::point_count() const {
+    return point_count_;
+}
+
+// writes cloud to the temporary file tmp, which is removed on failure
+static void
+write_e57_temporary_(const std::string& tmp, cloud_normal_t::Ptr cloud,
+                     const std::string& guid) {
+    try {
+        e57_pcl::write_e57n(tmp, cloud, guid);
+    } catch (...) {
+        discard_file(tmp);
+        throw;
+    }
+}
+
+file_sink::file_sink(const std::string& file_out)
+    : file_out_(file_out),
+      file_tmp_(temporary_path(file_out)),
+      out_(file_tmp_.c_str(), std::ios::out | std::ios::binary) {
+    if (!out_.good()) {
+        throw std::runtime_error("Unable to open file \"" + file_tmp_ +
+                                 "\" for writing.");
+    }
+}
+
+file_sink::~file_sink() {
+    if (out_.is_open()) {
+        out_.close();
+        discard_file(file_tmp_);
+    }
+}
+
+void
+file_sink::write(cloud_normal_t::ConstPtr cloud) {
+    write_records_(out_, cloud);
+    point_count_ += cloud->size();
+}
+
+void
+file_sink::commit_() {
+    out_.close();
+    if (out_.fail()) {
+        discard_file(file_tmp_);
+        throw std::runtime_error("Unable to write file \"" + file_tmp_ + "\".");
+    }
+    commit_file(file_tmp_, file_out_);
+}
+
+ply_sink::ply_sink(const std::string& file_out) : file_sink(file_out) {
+    out_ << "ply\n"
+         << "format binary_little_endian 1.0\n"
+         << "element vertex ";
+    count_pos_ = out_.tellp();
+    // fixed width placeholder, overwritten in finish()
+    out_ << std::string(20, ' ') << "\n"
+         << "property float x\n"
+         << "property float y\n"
+         << "property float z\n"
+         << "property float nx\n"
+         << "property float ny\n"
+         << "property float nz\n"
+         << "end_header\n";
+}
+
+ply_sink::~ply_sink() {}
+
+void
+ply_sink::finish() {
+    char count[21];
+    std::snprintf(count, sizeof(count), "%-20llu",
+                  static_cast<unsigned long long>(point_count_));
+    out_.seekp(count_pos_);
+    out_.write(count, 20);
+    commit_();
+}
+
+raw_sink::raw_sink(const std::string& file_out) : file_sink(file_out) {}
+
+raw_sink::~raw_sink() {}
+
+void
+raw_sink::finish() {
+    commit_();
+}
+
+e57_sink::e57_sink(const std::string& file_out, bool split_scans)
+    : file_out_(file_out),
+      split_scans_(split_scans),
+      scan_index_(0),
+      cloud_(new cloud_normal_t()) {}
+
+e57_sink::~e57_sink() {
+    // unfinished, none of the scan files may appear
+    for (const auto& file : pending_) {
+        discard_file(file.first);
+    }
+}
+
+void
+e57_sink::begin_scan(uint32_t scan_index, const vec3f_t& scan_origin) {
+    scan_index_ = scan_index;
+    if (split_scans_) {
+        cloud_.reset(new cloud_normal_t());
+    }
+    if (cloud_->empty()) {
+        cloud_->sensor_origin_.head(3) = scan_origin;
+    }
+}
+
+void
+e57_sink::write(cloud_normal_t::ConstPtr cloud) {
+    cloud_->insert(cloud_->end(), cloud->begin(), cloud->end());
+    point_count_ += cloud->size();
+}
+
+void
+e57_sink::end_scan() {
+    if (!split_scans_) return;
+
+    boost::filesystem::path path(file_out_);
+    std::string suffix = "_scan" + std::to_string(scan_index_);
+    boost::filesystem::path scan_path =
+        path.parent_path() /
+        (path.stem().string() + suffix + path.extension().string());
+    std::string tmp = temporary_path(scan_path.string());
+    write_e57_temporary_(tmp, cloud_, path.stem().string() + suffix);
+    pending_.emplace_back(tmp, scan_path.string());
+    cloud_.reset(new cloud_normal_t());
+}
+
+void
+e57_sink::finish() {
+    if (!split_scans_) {
+        std::string tmp = temporary_path(file_out_);
+        write_e57_temporary_(tmp, cloud_,
+                             boost::filesystem::path(file_out_).stem().string());
+        pending_.emplace_back(tmp, file_out_);
+    }
+    while (!pending_.empty()) {
+        commit_file(pending_.front().first, pending_.front().second);
+        pending_.pop_front();
+    }
+    cloud_.reset(new cloud_normal_t());
+}
+
+point_sink::ptr_t
+make_point_sink(const std::string& file_out, std::string format,
+                uint32_t scan_count) {
+    if (format == "") {
+        std::string ext = boost::filesystem::path(file_out).extension().string();
+        boost::algorithm::to_lower(ext);
+        if (ext == ".ply") {
+            format = "ply";
+        } else if (ext == ".raw" || ext == ".bin") {
+            format = "raw";
+        } else {
+            format = "e57";
+        }
+    }
+
+    if (format == "ply") return std::make_shared<ply_sink>(file_out);
+    if (format == "raw") return std::make_shared<raw_sink>(file_out);
+    if (format == "e57") return std::make_shared<e57_sink>(file_out, scan_count > 1);
+    throw std::runtime_error("Unknown output format \"" + format + "\"");
+}
+
+}  // duraark_compress
@@ -0,0 +1,102 @@
+#include <progress.hpp>
+
+#include <algorithm>
+#include <sstream>
+
+namespace duraark_compress {
+
+progress_reporter::progress_reporter(std::ostream& out, uint32_t scan_count,
+                                     uint64_t total_points)
+    : out_(out),
+      start_(std::chrono::steady_clock::now()),
+      scan_start_(start_),
+      restore_time_(0.0),
+      scan_count_(scan_count),
+      scans_done_(0),
+      total_points_(total_points),
+      points_done_(0),
+      scans_computed_(0),
+      points_computed_(0),
+      patches_(0),
+      bytes_(0) {
+    emit_("start", -1);
+}
+
+progress_reporter::~progress_reporter() {}
+
+void
+progress_reporter::begin_scan(uint32_t scan) {
+    scan_start_ = std::chrono::steady_clock::now();
+    emit_("scan_begin", scan);
+}
+
+void
+progress_reporter::end_scan(uint32_t scan, uint64_t points, uint32_t patches,
+                            uint64_t bytes) {
+    add_scan_(points, patches, bytes);
+    ++scans_computed_;
+    points_computed_ += points;
+    emit_("scan_done", scan);
+}
+
+void
+progress_reporter::restore_scan(uint32_t scan, uint64_t points,
+                                uint32_t patches, uint64_t bytes) {
+    add_scan_(points, patches, bytes);
+    restore_time_ += std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - scan_start_).count();
+    emit_("scan_restored", scan);
+}
+
+void
+progress_reporter::finish(uint64_t bytes) {
+    bytes_ = bytes;
+    emit_("finished", -1);
+}
+
+void
+progress_reporter::cancel() {
+    emit_("cancelled", -1);
+}
+
+void
+progress_reporter::add_scan_(uint64_t points, uint32_t patches,
+                             uint64_t bytes) {
+    ++scans_done_;
+    points_done_ += points;
+    patches_ += patches;
+    bytes_ += bytes;
+}
+
+void
+progress_reporter::emit_(const char* event, int64_t scan) {
+    double elapsed = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start_).count();
+
+    std::ostringstream line;
+    line << "{\"event\":\"" << event << "\"";
+    if (scan >= 0) {
+        line << ",\"scan\":" << scan;
+    }
+    line << ",\"scans_done\":" << scans_done_
+         << ",\"scan_count\":" << scan_count_
+         << ",\"points_done\":" << points_done_
+         << ",\"points_total\":" << total_points_
+         << ",\"patches\":" << patches_
+         << ",\"bytes\":" << bytes_
+         << ",\"elapsed\":" << elapsed << ",\"eta\":";
+    // restored scans took no computation, they must not inflate the rate
+    double computing = std::max(0.0, elapsed - restore_time_);
+    if (points_computed_ && total_points_ >= points_done_) {
+        line << computing * (total_points_ - points_done_) / points_computed_;
+    } else if (scans_computed_ && scans_done_ <= scan_count_) {
+        // no point counts known, extrapolate per scan
+        line << computing * (scan_count_ - scans_done_) / scans_computed_;
+    } else {
+        line << "null";
+    }
+    line << "}\n";
+    out_ << line.str() << std::flush;
+}
+
+}  // duraark_compress
@@ -1,15 +1,21 @@
 #include <quadtree.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <initializer_list>
+#include <numeric>
+
 namespace duraark_compress {
 
-quadtree::quadtree(const std::vector<vec2f_t>& points, const params_t& params) {
+quadtree::quadtree(const std::vector<vec2f_t>& points, const params_t& params,
+                   const std::vector<float>* heights) {
     bbox2f_t bbox;
     for (const auto& p : points) {
         bbox.extend(p);
     }
     node::indices_t subset(points.size());
     std::iota(subset.begin(), subset.end(), 0);
-    root_ = std::make_shared<node>(bbox, points, subset, params);
+    root_ = std::make_shared<node>(bbox, points, subset, params, 0, heights);
 }
 
 quadtree::~quadtree() {}
@@ -46,10 +52,16 @@ quadtree::leaves() {
 
 quadtree::node::node(const bbox2f_t& bbox, const std::vector<vec2f_t>& points,
                      const indices_t& subset, const params_t& params,
-                     uint32_t depth)
+                     uint32_t depth, const std::vector<float>* heights)
     : bbox_(bbox) {
-    if (depth >= params.max_depth ||
-        subset.size() <= params.max_points_per_cell) {
+    bool adaptive = heights && params.max_height_deviation > 0.f;
+    float max_points = params.max_points_per_cell;
+    if (adaptive) {
+        bool flat = deviation_(*heights, subset) <= params.max_height_deviation;
+        max_points = flat ? max_points * params.flat_cell_factor
+                          : max_points / params.flat_cell_factor;
+    }
+    if (depth >= params.max_depth || subset.size() <= max_points) {
         indices_ = subset;
     } else {
         vec2f_t center = bbox.center();
@@ -71,11 +83,17 @@ quadtree::node::node(const bbox2f_t& bbox, const std::vector<vec2f_t>& points,
                            (i / 2) ? (bbox.max()[1]) : (bbox.min()[1]));
             sub_bbox.extend(corner);
             children_.push_back(std::make_shared<node>(
-                sub_bbox, points, sub_indices, params, depth + 1));
+                sub_bbox, points, sub_indices, params, depth + 1, heights));
+        }
+        if (adaptive && params.merge_flat_cells) {
+            merge_flat_children_(*heights, params);
         }
     }
 }
 
+quadtree::node::node(const bbox2f_t& bbox, const indices_t& subset)
+    : bbox_(bbox), indices_(subset) {}
+
 quadtree::node::~node() {}
 
 quadtree::node::indices_t&
@@ -106,6 +124,68 @@ quadtree::node::inside_(uint32_t quadrant, const vec2f_t& point,
     return b0 == (quadrant % 2) && b1 == (quadrant / 2);
 }
 
+float
+quadtree::node::deviation_(const std::vector<float>& heights,
+                           const indices_t& subset) {
+    if (subset.size() < 2) return 0.f;
+    double sum = 0.0, sum_sq = 0.0;
+    for (const auto& idx : subset) {
+        sum += heights[idx];
+        sum_sq += static_cast<double>(heights[idx]) * heights[idx];
+    }
+    double mean = sum / subset.size();
+    return std::sqrt(std::max(0.0, sum_sq / subset.size() - mean * mean));
+}
+
+void
+quadtree::node::merge_flat_children_(const std::vector<float>& heights,
+                                     const params_t& params) {
+    const float max_points =
+        params.max_points_per_cell * params.flat_cell_factor;
+
+    // only groups covering a rectangle are merged, so the merged cell holds
+    // no unmerged sibling: all four quadrants, or adjacent pairs (quadrant
+    // i is right of center for odd i and above it for i >= 2)
+    auto mergeable = [&] (std::initializer_list<uint32_t> group,
+                          indices_t& merged) {
+        merged.clear();
+        for (const auto& i : group) {
+            if (!children_[i] || !children_[i]->children().empty()) {
+                return false;
+            }
+            const indices_t& leaf = children_[i]->indices();
+            merged.insert(merged.end(), leaf.begin(), leaf.end());
+        }
+        return merged.size() <= max_points &&
+               deviation_(heights, merged) <= params.max_height_deviation;
+    };
+
+    indices_t merged;
+    if (mergeable({0, 1, 2, 3}, merged)) {
+        indices_.swap(merged);
+        children_.clear();
+        return;
+    }
+
+    // either both rows or both columns, whichever merges more pairs
+    const uint32_t pairs[4][2] = {{0, 1}, {2, 3}, {0, 2}, {1, 3}};
+    std::vector<indices_t> pair_indices(4);
+    bool valid[4];
+    for (uint32_t p = 0; p < 4; ++p) {
+        valid[p] = mergeable({pairs[p][0], pairs[p][1]}, pair_indices[p]);
+    }
+    uint32_t first = (valid[0] + valid[1] >= valid[2] + valid[3]) ? 0 : 2;
+    for (uint32_t p = first; p < first + 2; ++p) {
+        if (!valid[p]) continue;
+        bbox2f_t merged_bbox = children_[pairs[p][0]]->bbox_;
+        merged_bbox.extend(children_[pairs[p][1]]->bbox_);
+        children_[pairs[p][0]] = nullptr;
+        children_[pairs[p][1]] = nullptr;
+        children_.push_back(
+            std::make_shared<node>(merged_bbox, pair_indices[p]));
+    }
+}
+
 quadtree::node_iterator::node_iterator() : node_() {}
 
 quadtree::node_iterator::node_iterator(node::wptr_t node) : node_(node) {
@@ -184,8 +264,12 @@ quadtree::leaf_iterator::leaf_iterator() : quadtree::node_iterator() {}
 
 quadtree::leaf_iterator::leaf_iterator(node::wptr_t node)
     : quadtree::node_iterator(node) {
+    // the root itself is the only leaf if it was never split or all of its
+    // children were merged back into it
     node::ptr_t p = node_.lock();
-    this->operator++();
+    if (p && p->children().size()) {
+        this->operator++();
+    }
 }
 
 quadtree::leaf_iterator::~leaf_iterator() {}
@@ -0,0 +1,120 @@
+#include <reorder.hpp>
+
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <compact_cloud.hpp>
+
+namespace duraark_compress {
+
+typedef std::pair<uint64_t, uint32_t> keyed_index_t;
+
+// spreads the lower 21 bits of v to every third bit
+static uint64_t
+spread_bits_(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+// sorts chunks in parallel and merges them pairwise
+static void
+parallel_sort_(std::vector<keyed_index_t>& keys) {
+    int chunks = 1;
+#ifdef _OPENMP
+    chunks = omp_get_max_threads();
+#endif
+    if (chunks < 2 || keys.size() < 65536) {
+        std::sort(keys.begin(), keys.end());
+        return;
+    }
+    std::vector<std::size_t> bounds(chunks + 1);
+    for (int c = 0; c <= chunks; ++c) {
+        bounds[c] = keys.size() * c / chunks;
+    }
+    #pragma omp parallel for schedule(static, 1)
+    for (int c = 0; c < chunks; ++c) {
+        std::sort(keys.begin() + bounds[c], keys.begin() + bounds[c + 1]);
+    }
+    for (int width = 1; width < chunks; width *= 2) {
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int c = 0; c < chunks - width; c += 2 * width) {
+            std::inplace_merge(keys.begin() + bounds[c],
+                               keys.begin() + bounds[c + width],
+                               keys.begin() + bounds[std::min(c + 2 * width, chunks)]);
+        }
+    }
+}
+
+template <typename PositionFunc>
+static std::vector<uint32_t>
+morton_order_(uint32_t num_points, PositionFunc&& position) {
+    bbox3f_t bbox;
+    for (uint32_t i = 0; i < num_points; ++i) {
+        vec3f_t p = position(i);
+        if (p.allFinite()) bbox.extend(p);
+    }
+    float extent = bbox.sizes().maxCoeff();
+    float scale = extent > 0.f ? 2097151.f / extent : 0.f;
+
+    std::vector<keyed_index_t> keys(num_points);
+    #pragma omp parallel for schedule(static)
+    for (uint32_t i = 0; i < num_points; ++i) {
+        vec3f_t p = (position(i) - bbox.min()) * scale;
+        if (!p.allFinite()) {
+            // invalid points go last
+            keys[i] = keyed_index_t(~0ull, i);
+            continue;
+        }
+        uint64_t code = spread_bits_(static_cast<uint64_t>(p[0])) |
+                        spread_bits_(static_cast<uint64_t>(p[1])) << 1 |
+                        spread_bits_(static_cast<uint64_t>(p[2])) << 2;
+        keys[i] = keyed_index_t(code, i);
+    }
+    parallel_sort_(keys);
+
+    std::vector<uint32_t> order(keys.size());
+    for (uint32_t i = 0; i < keys.size(); ++i) {
+        order[i] = keys[i].second;
+    }
+    return order;
+}
+
+std::vector<uint32_t>
+morton_order(const cloud_normal_t& cloud) {
+    return morton_order_(cloud.size(), [&] (uint32_t i) -> vec3f_t {
+        return cloud.points[i].getVector3fMap();
+    });
+}
+
+std::vector<uint32_t>
+morton_order(const compact_cloud& cloud) {
+    return morton_order_(cloud.size(), [&] (uint32_t i) {
+        return cloud.point(i);
+    });
+}
+
+void
+apply_order(cloud_normal_t& cloud, const std::vector<uint32_t>& order) {
+    cloud_normal_t::VectorType points(order.size());
+    #pragma omp parallel for schedule(static)
+    for (uint32_t i = 0; i < order.size(); ++i) {
+        points[i] = cloud.points[order[i]];
+    }
+    cloud.points.swap(points);
+    cloud.width = cloud.points.size();
+    cloud.height = 1;
+}
+
+void
+apply_order(compact_cloud& cloud, const std::vector<uint32_t>& order) {
+    cloud.permute(order);
+}
+
+}  // duraark_compress
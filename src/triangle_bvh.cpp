@@ -0,0 +1,144 @@
+#include <triangle_bvh.hpp>
+
+namespace duraark_compress {
+
+// median splits halve the face range per level, so the depth of a tree over
+// at most 2^32 faces stays below 34
+static const uint32_t max_depth_ = 64;
+
+triangle_bvh::triangle_bvh(ifc_mesh::const_ptr_t mesh, uint32_t max_leaf_size)
+    : mesh_(mesh), max_leaf_size_(std::max(1u, max_leaf_size)) {
+    const auto& faces = mesh_->faces();
+    const auto& vertices = mesh_->vertices();
+    faces_.resize(faces.size());
+    std::iota(faces_.begin(), faces_.end(), 0);
+    centroids_.resize(faces.size());
+    for (uint32_t i = 0; i < faces.size(); ++i) {
+        const auto& v = faces[i].vertices;
+        centroids_[i] = (vertices[v[0]] + vertices[v[1]] + vertices[v[2]]) / 3.f;
+    }
+    if (!faces_.empty()) {
+        build_(0, faces_.size());
+    }
+}
+
+triangle_bvh::~triangle_bvh() {}
+
+ex::optional<triangle_bvh::hit_t>
+triangle_bvh::closest(const vec3f_t& point, float max_distance) const {
+    if (nodes_.empty()) return ex::nullopt;
+
+    float best = max_distance * max_distance;
+    int64_t best_face = -1;
+    // depth first, the stack never holds more than depth + 1 nodes, so
+    // queries do not allocate
+    int32_t stack[max_depth_ + 1];
+    uint32_t size = 0;
+    stack[size++] = 0;
+    while (size) {
+        const node_t& node = nodes_[stack[--size]];
+        if (node.bbox.squaredExteriorDistance(point) > best) continue;
+
+        if (node.left < 0) {
+            for (uint32_t i = node.begin; i < node.end; ++i) {
+                float dist = squared_distance_(point, faces_[i]);
+                if (dist <= best) {
+                    best = dist;
+                    best_face = faces_[i];
+                }
+            }
+            continue;
+        }
+
+        // visit nearer child first
+        float dist_left = nodes_[node.left].bbox.squaredExteriorDistance(point);
+        float dist_right = nodes_[node.right].bbox.squaredExteriorDistance(point);
+        if (dist_left < dist_right) {
+            stack[size++] = node.right;
+            stack[size++] = node.left;
+        } else {
+            stack[size++] = node.left;
+            stack[size++] = node.right;
+        }
+    }
+
+    if (best_face < 0) return ex::nullopt;
+    return hit_t{static_cast<uint32_t>(best_face), std::sqrt(best)};
+}
+
+int32_t
+triangle_bvh::build_(uint32_t begin, uint32_t end) {
+    const auto& faces = mesh_->faces();
+    const auto& vertices = mesh_->vertices();
+
+    int32_t index = nodes_.size();
+    nodes_.push_back({bbox3f_t(), begin, end, -1, -1});
+    bbox3f_t bbox, centroid_bbox;
+    for (uint32_t i = begin; i < end; ++i) {
+        for (const auto& v : faces[faces_[i]].vertices) {
+            bbox.extend(vertices[v]);
+        }
+        centroid_bbox.extend(centroids_[faces_[i]]);
+    }
+    nodes_[index].bbox = bbox;
+    if (end - begin <= max_leaf_size_) return index;
+
+    // median split along longest centroid extent
+    int axis;
+    centroid_bbox.sizes().maxCoeff(&axis);
+    uint32_t mid = begin + (end - begin) / 2;
+    std::nth_element(faces_.begin() + begin, faces_.begin() + mid,
+                     faces_.begin() + end, [&](uint32_t a, uint32_t b) {
+                         return centroids_[a][axis] < centroids_[b][axis];
+                     });
+    int32_t left = build_(begin, mid);
+    int32_t right = build_(mid, end);
+    nodes_[index].left = left;
+    nodes_[index].right = right;
+    return index;
+}
+
+// closest point on triangle, see Ericson - Real-Time Collision Detection 5.1.5
+float
+triangle_bvh::squared_distance_(const vec3f_t& p, uint32_t face) const {
+    const auto& v = mesh_->faces()[face].vertices;
+    const vec3f_t& a = mesh_->vertices()[v[0]];
+    const vec3f_t& b = mesh_->vertices()[v[1]];
+    const vec3f_t& c = mesh_->vertices()[v[2]];
+
+    vec3f_t ab = b - a, ac = c - a, ap = p - a;
+    float d1 = ab.dot(ap), d2 = ac.dot(ap);
+    if (d1 <= 0.f && d2 <= 0.f) return ap.squaredNorm();
+
+    vec3f_t bp = p - b;
+    float d3 = ab.dot(bp), d4 = ac.dot(bp);
+    if (d3 >= 0.f && d4 <= d3) return bp.squaredNorm();
+
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f) {
+        float t = d1 / (d1 - d3);
+        return (p - (a + t * ab)).squaredNorm();
+    }
+
+    vec3f_t cp = p - c;
+    float d5 = ab.dot(cp), d6 = ac.dot(cp);
+    if (d6 >= 0.f && d5 <= d6) return cp.squaredNorm();
+
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f) {
+        float t = d2 / (d2 - d6);
+        return (p - (a + t * ac)).squaredNorm();
+    }
+
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0.f && (d4 - d3) >= 0.f && (d5 - d6) >= 0.f) {
+        float t = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+        return (p - (b + t * (c - b))).squaredNorm();
+    }
+
+    float denom = 1.f / (va + vb + vc);
+    float s = vb * denom, t = vc * denom;
+    return (p - (a + ab * s + ac * t)).squaredNorm();
+}
+
+}  // duraark_compress
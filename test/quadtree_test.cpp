@@ -0,0 +1,148 @@
+// Checks that iterating the leaves of a quadtree visits every point exactly
+// once, including trees whose root is a leaf itself, and that planarity
+// splitting and merging of flat cells reduce the number of leaves.
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+#include <random>
+
+#include <quadtree.hpp>
+using namespace duraark_compress;
+
+static int failures = 0;
+
+static void
+check(bool condition, const std::string& what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << "\n";
+        ++failures;
+    }
+}
+
+// true if the leaves below root partition the indices 0..count-1
+static bool
+covers(quadtree::leaf_iterator begin, quadtree::leaf_iterator end,
+       uint32_t count, uint32_t& leaves) {
+    std::vector<int> seen;
+    leaves = 0;
+    for (auto it = begin; it != end; ++it) {
+        seen.insert(seen.end(), it->indices().begin(), it->indices().end());
+        ++leaves;
+    }
+    std::sort(seen.begin(), seen.end());
+    if (seen.size() != count) return false;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (seen[i] != static_cast<int>(i)) return false;
+    }
+    return true;
+}
+
+static std::vector<vec2f_t>
+grid(uint32_t size) {
+    std::vector<vec2f_t> points;
+    for (uint32_t y = 0; y < size; ++y) {
+        for (uint32_t x = 0; x < size; ++x) {
+            points.push_back(vec2f_t(x * 0.01f, y * 0.01f));
+        }
+    }
+    return points;
+}
+
+int
+main(int argc, char const* argv[]) {
+    uint32_t leaves;
+
+    // root never split
+    {
+        std::vector<vec2f_t> points = grid(10);
+        std::vector<float> heights(points.size(), 0.f);
+        quadtree qt(points, {10, 1024, 0.01f, 4.f, true}, &heights);
+        check(covers(qt.leaves_begin(), qt.leaves_end(), points.size(), leaves),
+              "unsplit root covers all points");
+        check(leaves == 1, "unsplit root is the only leaf");
+    }
+
+    // root whose children were all merged back into it
+    {
+        std::vector<vec2f_t> points = grid(10);
+        quadtree::node::indices_t subset(points.size());
+        std::iota(subset.begin(), subset.end(), 0);
+        bbox2f_t bbox;
+        for (const auto& p : points) bbox.extend(p);
+        quadtree::node_ptr_t root =
+            std::make_shared<quadtree::node>(bbox, points, subset,
+                                             quadtree::params_t{10, 10, 0.f, 1.f, false});
+        check(!root->children().empty(), "root is split");
+        root->children().clear();
+        root->indices() = subset;
+        check(covers(quadtree::leaf_iterator(root), quadtree::leaf_iterator(),
+                     points.size(), leaves),
+              "collapsed root covers all points");
+        check(leaves == 1, "collapsed root is the only leaf");
+    }
+
+    // flat plane, the planarity threshold lets cells hold more points
+    {
+        std::vector<vec2f_t> points = grid(60);
+        std::vector<float> heights(points.size(), 0.f);
+        uint32_t count_only, planar;
+        quadtree by_count(points, {10, 1024, 0.f, 4.f, false}, &heights);
+        covers(by_count.leaves_begin(), by_count.leaves_end(), points.size(), count_only);
+        quadtree by_planarity(points, {10, 1024, 0.01f, 4.f, false}, &heights);
+        check(covers(by_planarity.leaves_begin(), by_planarity.leaves_end(),
+                     points.size(), planar),
+              "flat plane covers all points");
+        check(planar < count_only,
+              "flat plane gives fewer leaves with a planarity threshold");
+    }
+
+    // merging flat cells, only adjacent quadrants are merged
+    for (bool diagonal : {false, true}) {
+        std::vector<vec2f_t> points = grid(60);
+        std::vector<float> heights;
+        std::mt19937 gen(1);
+        std::normal_distribution<float> noise(0.f, 0.05f);
+        for (const auto& p : points) {
+            bool right = p[0] >= 0.295f, top = p[1] >= 0.295f;
+            // rough top right quadrant, or rough bottom right and top left
+            bool rough = diagonal ? right != top : right && top;
+            heights.push_back(rough ? noise(gen) : 0.f);
+        }
+        uint32_t separate, merged;
+        quadtree qt(points, {10, 1024, 0.01f, 4.f, false}, &heights);
+        covers(qt.leaves_begin(), qt.leaves_end(), points.size(), separate);
+        quadtree qt_merged(points, {10, 1024, 0.01f, 4.f, true}, &heights);
+        check(covers(qt_merged.leaves_begin(), qt_merged.leaves_end(),
+                     points.size(), merged),
+              "merged tree covers all points");
+        if (diagonal) {
+            check(merged == separate, "diagonal flat quadrants stay separate");
+        } else {
+            check(merged < separate, "adjacent flat quadrants are merged");
+        }
+    }
+
+    // split tree with and without merging of flat cells
+    for (bool merge : {false, true}) {
+        std::vector<vec2f_t> points = grid(60);
+        std::vector<float> heights;
+        std::mt19937 gen(1);
+        std::normal_distribution<float> noise(0.f, 0.05f);
+        for (const auto& p : points) {
+            bool rough = p[0] >= 0.295f && p[1] >= 0.295f;
+            heights.push_back(rough ? noise(gen) : 0.f);
+        }
+        quadtree qt(points, {10, 1024, 0.01f, 4.f, merge}, &heights);
+        check(covers(qt.leaves_begin(), qt.leaves_end(), points.size(), leaves),
+              std::string("split tree covers all points, merge ") +
+                  (merge ? "on" : "off"));
+        check(leaves > 1, "split tree has several leaves");
+    }
+
+    if (failures) {
+        std::cerr << failures << " checks failed" << "\n";
+        return 1;
+    }
+    std::cout << "all checks passed" << "\n";
+    return 0;
+}